@@ -59,21 +59,63 @@
  *                 Currently supporting circlular and triangular windows
  */
 
+#define _GNU_SOURCE /* SCHED_IDLE and CPU affinity */
+
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/extensions/dpms.h>
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#endif
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef HAVE_XSS
+#include <X11/extensions/scrnsaver.h>
+#endif
+#ifdef HAVE_XRES
+#include <X11/extensions/XRes.h>
+#endif
 #include <X11/extensions/shape.h>
+#ifdef HAVE_X11_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
+#ifdef HAVE_PNG
+#include <png.h>
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/shm.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define WIDTH  512
@@ -85,7 +127,34 @@
 
 #define WID_PLACEHOLDER "%WID"
 
-#define ATOM(a) XInternAtom(display, #a, False)
+/* Every atom used is interned with a single XInternAtoms() request in
+ * init_x11(), instead of a round trip per ATOM() use. */
+#define ATOMS(X)                                                                                   \
+    X(ESETROOT_PMAP_ID)                                                                            \
+    X(__SWM_VROOT)                                                                                 \
+    X(_MOTIF_WM_HINTS)                                                                             \
+    X(_NET_CLIENT_LIST_STACKING)                                                                   \
+    X(_NET_WM_DESKTOP)                                                                             \
+    X(_NET_WM_PID)                                                                                 \
+    X(_NET_WM_STATE)                                                                               \
+    X(_NET_WM_STATE_ABOVE)                                                                         \
+    X(_NET_WM_STATE_BELOW)                                                                         \
+    X(_NET_WM_STATE_SKIP_PAGER)                                                                    \
+    X(_NET_WM_STATE_SKIP_TASKBAR)                                                                  \
+    X(_NET_WM_STATE_STICKY)                                                                        \
+    X(_NET_WM_WINDOW_OPACITY)                                                                      \
+    X(_NET_WM_WINDOW_TYPE)                                                                         \
+    X(_NET_WM_WINDOW_TYPE_DESKTOP)                                                                 \
+    X(_NET_WM_WINDOW_TYPE_NORMAL)                                                                  \
+    X(_WIN_LAYER)                                                                                  \
+    X(_XROOTPMAP_ID)
+
+#define ATOM_ENUM(a) ATOM_##a,
+#define ATOM_NAME(a) #a,
+
+enum { ATOMS(ATOM_ENUM) ATOM_COUNT };
+
+#define ATOM(a) atoms[ATOM_##a]
 
 #define SETFLAG(flag, var)                                                                         \
     if (strcmp(argv[i], flag) == 0) {                                                              \
@@ -111,10 +180,12 @@ typedef enum {
     SHAPE_RECT = 0,
     SHAPE_CIRCLE,
     SHAPE_TRIG,
+    SHAPE_MASK,
 } win_shape;
 
 struct window {
     Window root, window, desktop, child;
+    Window inner; /* where the child renders: window, or an offscreen window with -scale */
     Drawable drawable;
     Visual *visual;
     Colormap colourmap;
@@ -123,15 +194,384 @@ struct window {
     unsigned int height;
     int x;
     int y;
+
+    pid_t pid;
+    int pidfd;
+    unsigned int paused; /* PAUSE_* reasons the child is stopped for */
+    bool evicted;        /* -psi, -power: the child was terminated to be started again */
+    bool restarting;     /* -restart: the child crashed and is started again soon */
+    bool swapping;       /* -control, -pixmap-max: the child is replaced once reaped */
+    uint64_t started;    /* when the child was started, in ms */
+    unsigned int restarts, crashes; /* crashes counts quick crashes in a row */
+    uint64_t backoff;
+    bool drawn;             /* the child has drawn its first frame */
+    uint64_t snapshot_hash; /* -snapshot: of the pixels last saved */
+    double cpu;             /* -metrics: of the child's process group */
+    unsigned long rss;
+    pid_t metrics_pid;          /* -metrics: the child procs were found for */
+    struct metrics_proc *procs; /* members of its process group */
+    int nprocs, procs_cap;
+    uint64_t metrics_time;
+#ifdef HAVE_XRES
+    unsigned long child_pixmaps;
+    unsigned long pixmaps_before; /* -pixmap-max: of the child last restarted */
+    bool pixmaps_warned;
+#endif
+    Picture picture;     /* set while the window is a mirror target */
+#ifdef HAVE_XRANDR
+    RRCrtc crtc; /* -per-output: the CRTC the window covers */
+#endif
+#ifdef HAVE_XDAMAGE
+    Damage damage; /* -freeze, -max-fps: damage of the child window */
+    bool damaged;
+    unsigned int frames; /* -max-fps: damage events in this FPS_WINDOW */
+    double duty;
+    unsigned long frames_total, metrics_frames; /* -metrics */
+    double fps;
+    Picture rootpmap_picture; /* -rootpmap: of the window and its child */
+    bool snapshot_damaged;    /* -snapshot: drawn since the last save */
+#endif
 } window;
 
+/* All wrapper windows, &window first. There is more than one only with
+ * -per-output. */
+#define MAX_WINDOWS 16
+
+static struct window *windows[MAX_WINDOWS] = { &window };
+static int nwindows = 1;
+
 bool debug = false;
 
-static pid_t pid = 0;
+static win_shape shape = SHAPE_RECT;
+
+/* -sh FILE */
+#define SHAPE_MAGIC "XWWSHAP1"
+
+struct shape_header {
+    char magic[8];
+    uint32_t count;
+};
+
+static struct {
+    char *path, *cache;
+    uint64_t hash; /* of the file */
+    unsigned int width, height;
+    unsigned char *pixels; /* one byte per pixel, 1 inside the shape */
+} shape_mask;
+
+static bool fullscreen = false;
+static bool per_output = false;
+static bool mirror_outputs = false;
+static double render_scale = 1.0;
+
+/* window options, see create_window() */
+static bool have_argb_visual = false;
+static bool no_input = false;
+static bool set_desktop_type = false;
+static bool no_focus = false;
+static bool override = false;
+static bool undecorated = false;
+static bool sticky = false;
+static bool below = false;
+static bool above = false;
+static bool skip_taskbar = false;
+static bool skip_pager = false;
+static unsigned int opacity = OPAQUE;
+static int depth = 0;
+static Visual *visual = NULL;
+static char **wm_argv = NULL;
+static int wm_argc = 0;
+
+#ifdef HAVE_XRANDR
+static bool have_xrandr = false;
+static int xrandr_event_base;
+#endif
+
+#ifdef HAVE_XDAMAGE
+static bool have_damage = false;
+static int damage_event_base, damage_error_base;
+static uint64_t freeze_ms = 0;
+
+#define FPS_WINDOW   1000
+#define FPS_MIN_DUTY 0.02
+
+static double max_fps = 0;
+
+/* -rootpmap: a copy of the wrappers published as the root pixmap, for
+ * clients with pseudo-transparency. */
+static struct {
+    double rate; /* updates a second at most */
+    Pixmap pixmap, old;
+    Picture picture;
+    XserverRegion dirty, parts; /* what changed since the last update, in root coordinates */
+    uint64_t last;
+    bool pending;
+} rootpmap;
+
+/* Server-side copies of one source window into target windows, driven by
+ * XDamage, so the pixels never travel to the client. The source is
+ * redirected with Composite and read through its named window pixmap. */
+struct mirror {
+    Window source;
+    Pixmap pixmap;
+    Picture picture;
+    Damage damage;
+    unsigned int width, height;
+    struct window *targets[MAX_WINDOWS];
+    int ntargets;
+
+    /* bounding box of the damage not copied yet */
+    bool dirty;
+    int x1, y1, x2, y2;
+} mirror;
+#endif
+
+/* -image: decoded frames live in server-side pixmaps. Over the memory
+ * budget only keyframes are whole, the frames between them hold the area
+ * changed since the previous frame and are composed into the canvas. */
+#define IMAGE_KEYFRAME_INTERVAL 30
+#define IMAGE_BUDGET            256
+
+struct image_frame {
+    Pixmap pixmap; /* None if nothing changed */
+    int x, y;
+    unsigned int width, height;
+    unsigned int delay; /* ms */
+};
+
+struct image {
+    struct image_frame *frames;
+    int nframes, current;
+    int loops, played; /* NETSCAPE loop count, -1 to play once */
+    unsigned int width, height;
+    int depth;
+    int shift[3], bits[3];
+    Pixmap canvas; /* set when frames are deltas */
+    GC gc;
+    size_t bytes;
+    bool playing;
+} image;
+
+static size_t image_budget = (size_t) IMAGE_BUDGET << 20;
+
+/* -stream: frames of a raw BGRA pipe in shared memory buffers */
+#define STREAM_BUFFERS 3
+
+enum { STREAM_FREE, STREAM_FILLING, STREAM_READY, STREAM_SHOWN };
+
+struct stream {
+    int fd;
+    int stdin_flags; /* to put back, when stdin itself had to be made non-blocking */
+    unsigned int width, height;
+    size_t frame_size, filled;
+    XShmSegmentInfo shm[STREAM_BUFFERS];
+    XImage *images[STREAM_BUFFERS]; /* images[0] is set with -stream */
+    int state[STREAM_BUFFERS];
+    int fill, shown;
+    bool reading;
+    int pending; /* puts not completed yet */
+    int completion;
+    GC gc;
+} stream;
+
+static Atom atoms[ATOM_COUNT];
+
+/* -trace state, round trips are counted at each call waiting for a reply */
+static bool trace = false;
+static unsigned long round_trips = 0;
+static uint64_t trace_start, trace_last;
+static unsigned long trace_last_round_trips, trace_last_request;
+#ifdef HAVE_X11_XCB
+/* the last request sent through XCB, Xlib only counts it once it sends again */
+static unsigned long trace_xcb_request;
+#endif
+
+/* Reasons for the child process group being stopped. The child runs only
+ * while no reason is set. */
+#define PAUSE_COVERED    (1 << 0)
+#define PAUSE_OUTPUT_OFF (1 << 1)
+#define PAUSE_DPMS       (1 << 2)
+#define PAUSE_FROZEN     (1 << 3)
+#define PAUSE_BLANKED    (1 << 4)
+#define PAUSE_IDLE       (1 << 5)
+#define PAUSE_FPS        (1 << 6)
+#define PAUSE_BACKOFF    (1 << 7)
+#define PAUSE_CONTROL    (1 << 8)
+
+/* DPMS has no events, its state is polled */
+#define DPMS_INTERVAL 5000
+
+/* -idle and backoff level 1 let the child run for IDLE_RUN_MS out of every
+ * IDLE_RUN_MS + IDLE_STOP_MS */
+#define IDLE_RUN_MS  50
+#define IDLE_STOP_MS 150
+
+/* -psi: triggers are over PSI_WINDOW microseconds, which unprivileged users
+ * may only use in multiples of 2 s */
+#define PSI_WINDOW 2000000
+#define PSI_HOLD   10000
+
+static int psi_level = 0;
+
+/* -power: the backoff level on AC, on battery and on low battery */
+#define POWER_ROOT "/sys/class/power_supply"
+#define POWER_LOW  20
+
+static char *power_root = POWER_ROOT;
+static int power_levels[3] = { 0, 0, 0 };
+static int power_low = 0;
+static int power_level = 0;
+
+static int backoff_level = 0;
+static bool backoff_stopped = false;
+
+#ifdef HAVE_XSS
+#define IDLE_POLL 1000
+
+static bool have_xss = false;
+static int xss_event_base;
+static unsigned long idle_ms = 0;
+static bool idling = false, idle_stopped = false;
+#endif
+
+/* Event loop: file descriptors and timers dispatched from run_loop(). The X
+ * connection is always part of it. */
+#define MAX_WATCHES 64
+#define MAX_TIMERS  32
+
+typedef void (*watch_cb)(int fd, short revents, void *data);
+typedef void (*timer_cb)(void *data);
+
+struct watch {
+    int fd;
+    short events;
+    watch_cb cb;
+    void *data;
+};
+
+struct timer {
+    uint64_t due;
+    timer_cb cb;
+    void *data;
+};
+
+static struct watch watches[MAX_WATCHES];
+static int nwatches = 0;
+static struct timer timers[MAX_TIMERS];
+static int ntimers = 0;
+static bool running = true;
+
+static bool visibility_dirty = false;
+
+static long root_event_mask = NoEventMask;
+
+/* -fa state: the child's process tree and the top-level windows watched
+ * for its _NET_WM_PID or WM_CLASS */
+#define ATTACH_TIMEOUT 10000
+
+static bool force_attach = false;
+static bool attaching = false;
+static char *attach_class = NULL;
+static pid_t *tree_pids = NULL;
+static int ntree_pids = 0, tree_pids_cap = 0;
+static Window *watched = NULL;
+static int nwatched = 0, watched_cap = 0;
 
 static char **child_argv = NULL;
 static int child_argc = 0;
 
+/* -restart: a crashed child is started again after a backoff doubling from
+ * RESTART_MIN to RESTART_MAX. A run of RESTART_STABLE resets the backoff and
+ * the count of crashes in a row, of which restart_limit are allowed. */
+#define RESTART_MIN    1000
+#define RESTART_MAX    60000
+#define RESTART_STABLE 60000
+
+static int restart_limit = 0;
+static bool stopping = false;
+
+/* -snapshot */
+#define SNAPSHOT_MAGIC    "XWWSNAP1"
+#define SNAPSHOT_INTERVAL 120000
+#define SNAPSHOT_MAX_AGE  (30 * 24 * 3600) /* seconds a snapshot is kept unused */
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t width, height, depth, stride;
+    uint64_t hash;
+};
+
+static char *snapshot_dir = NULL;
+
+/* -playlist: commands run through sh -c in turn, one every rotate_ms. warm
+ * holds the child starting up offscreen, then the replaced one until it is
+ * reaped. */
+#define PLAYLIST_INTERVAL 600
+
+static uint64_t rotate_ms = PLAYLIST_INTERVAL * 1000;
+#ifdef HAVE_XDAMAGE
+static char **playlist = NULL;
+static int nplaylist = 0, playlist_pos = 0;
+static char *playlist_argv[] = { "/bin/sh", "-c", NULL, NULL };
+static struct window warm;
+static unsigned long playlist_armed = 0; /* serial from which damage is drawing */
+#endif
+static char *wid_placeholder = WID_PLACEHOLDER;
+
+/* -control */
+#define CONTROL_CLIENTS 8
+
+struct control_client {
+    int fd;
+    char buf[1024];
+    size_t len;
+};
+
+static const char *control_path = NULL;
+static struct control_client control_clients[CONTROL_CLIENTS];
+static char *control_argv[] = { "/bin/sh", "-c", NULL, NULL };
+
+/* -metrics */
+#define METRICS_INTERVAL 10000
+#define METRICS_RESCAN   6 /* collections between lookups of the process group */
+
+struct metrics_proc {
+    int stat_fd, smaps_fd;
+};
+
+static char *metrics_path = NULL;
+#ifdef HAVE_XRES
+static bool have_xres = false;
+static unsigned long own_pixmaps = 0;
+#endif
+
+/* -pixmap-max */
+#define PIXMAP_INTERVAL 30000
+
+#ifdef HAVE_XRES
+static unsigned long pixmap_max = 0;
+#endif
+static bool pixmap_restart = false;
+static sigset_t child_sigmask;
+
+/* scheduling of the child, see set_child_scheduling() */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_CLASS_SHIFT 13
+
+static int child_nice = 0;
+static bool child_sched_idle = false;
+static bool child_io_idle = false;
+static cpu_set_t child_cpus;
+
+/* the cgroup v2 leaf the children run in */
+#define CGROUP_ROOT     "/sys/fs/cgroup"
+#define CGROUP_PERIOD   100000
+#define CGROUP_INTERVAL 10000
+
+static char *cgroup_path = NULL;
+static unsigned long cgroup_events[4]; /* memory high, max, oom_kill, cpu nr_throttled */
+
 static void die(const char *fmt, ...) {
     va_list ap;
 
@@ -150,260 +590,4337 @@ static void die(const char *fmt, ...) {
     exit(1);
 }
 
-static void set_window_opacity(unsigned int opacity) {
+static uint64_t now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ms() {
+    return now_us() / 1000;
+}
+
+/* Report the wall time, round trips and requests spent since the previous
+ * phase. */
+static void trace_phase(const char *phase) {
+    uint64_t now;
+    unsigned long request;
+
+    if (!trace)
+        return;
+
+    now = now_us();
+    request = display ? NextRequest(display) : 0;
+#ifdef HAVE_X11_XCB
+    if (trace_xcb_request >= request)
+        request = trace_xcb_request + 1;
+#endif
+    fprintf(stderr, NAME ": trace %-14s %9.3f ms %4lu round trips %5lu requests (%.3f ms total)\n",
+        phase, (now - trace_last) / 1000.0, round_trips - trace_last_round_trips,
+        request - trace_last_request, (now - trace_start) / 1000.0);
+
+    trace_last = now;
+    trace_last_round_trips = round_trips;
+    trace_last_request = request;
+}
+
+static XErrorHandler default_error_handler;
+
+static int x_error_handler(Display *dpy, XErrorEvent *ev) {
+    /* Windows of other clients may vanish between listing and querying
+     * them, taking the damage on them along, which is not fatal for us.
+     * Anything else still is. */
+    bool vanished = ev->error_code == BadWindow || ev->error_code == BadDrawable;
+
+#ifdef HAVE_XDAMAGE
+    vanished = vanished || (have_damage && ev->error_code == damage_error_base + BadDamage);
+#endif
+    if (!vanished)
+        return default_error_handler(dpy, ev);
+
+    if (debug) {
+        char msg[128];
+
+        XGetErrorText(dpy, ev->error_code, msg, sizeof(msg));
+        fprintf(stderr, NAME ": X error on resource %lx: %s\n", ev->resourceid, msg);
+    }
+    return 0;
+}
+
+static void set_window_opacity(struct window *w, unsigned int opacity) {
     CARD32 o;
     o = opacity;
-    XChangeProperty(display, window.window, ATOM(_NET_WM_WINDOW_OPACITY), XA_CARDINAL, 32,
+    XChangeProperty(display, w->window, ATOM(_NET_WM_WINDOW_OPACITY), XA_CARDINAL, 32,
         PropModeReplace, (unsigned char *) &o, 1);
 }
 
 static void init_x11() {
+    char *atom_names[] = { ATOMS(ATOM_NAME) };
+
     display = XOpenDisplay(NULL);
     if (!display)
         die("Couldn't open display.");
+    round_trips++;
     screen = DefaultScreen(display);
     display_width = DisplayWidth(display, screen);
     display_height = DisplayHeight(display, screen);
+    default_error_handler = XSetErrorHandler(x_error_handler);
+
+#ifdef HAVE_XDAMAGE
+    {
+        int error_base, major = 2, minor = 0;
+
+        round_trips += 3;
+        have_damage = XDamageQueryExtension(display, &damage_event_base, &damage_error_base)
+            && XCompositeQueryExtension(display, &error_base, &error_base)
+            && XFixesQueryVersion(display, &major, &minor);
+    }
+#endif
+
+#ifdef HAVE_XRANDR
+    {
+        int error_base;
+
+        round_trips++;
+        have_xrandr = XRRQueryExtension(display, &xrandr_event_base, &error_base);
+    }
+#endif
+
+#ifdef HAVE_XSS
+    {
+        int error_base;
+
+        round_trips++;
+        have_xss = XScreenSaverQueryExtension(display, &xss_event_base, &error_base);
+    }
+#endif
+
+#ifdef HAVE_XRES
+    {
+        int event_base, error_base;
+
+        round_trips++;
+        have_xres = XResQueryExtension(display, &event_base, &error_base);
+    }
+#endif
+
+    if (!XInternAtoms(display, atom_names, ATOM_COUNT, False, atoms))
+        die("Couldn't intern atoms.");
+    round_trips++;
+    if (trace)
+        fprintf(stderr, NAME ": trace %d atoms interned in 1 round trip\n", ATOM_COUNT);
 }
 
-static int get_argb_visual(Visual **visual, int *depth) {
-    XVisualInfo visual_template;
-    XVisualInfo *visual_list;
-    int nxvisuals = 0, i;
+#ifdef HAVE_XDAMAGE
+static void mirror_damage(int x, int y, unsigned int width, unsigned int height) {
+    if (!mirror.dirty) {
+        mirror.x1 = x;
+        mirror.y1 = y;
+        mirror.x2 = x + width;
+        mirror.y2 = y + height;
+        mirror.dirty = true;
+        return;
+    }
+    if (x < mirror.x1)
+        mirror.x1 = x;
+    if (y < mirror.y1)
+        mirror.y1 = y;
+    if (x + (int) width > mirror.x2)
+        mirror.x2 = x + width;
+    if (y + (int) height > mirror.y2)
+        mirror.y2 = y + height;
+}
 
-    visual_template.screen = screen;
-    visual_list = XGetVisualInfo(display, VisualScreenMask, &visual_template, &nxvisuals);
-    for (i = 0; i < nxvisuals; i++) {
-        if (visual_list[i].depth == 32
-            && (visual_list[i].red_mask == 0xff0000 && visual_list[i].green_mask == 0x00ff00
-                && visual_list[i].blue_mask == 0x0000ff)) {
-            *visual = visual_list[i].visual;
-            *depth = visual_list[i].depth;
-            if (debug)
-                fprintf(stderr, "Found ARGB Visual\n");
-            XFree(visual_list);
-            return 1;
+/* (Re)name the source's window pixmap, needed again whenever the source is
+ * resized or remapped. */
+static void mirror_bind_source() {
+    XWindowAttributes attrs;
+    XRenderPictureAttributes pa;
+
+    if (mirror.picture)
+        XRenderFreePicture(display, mirror.picture);
+    if (mirror.pixmap)
+        XFreePixmap(display, mirror.pixmap);
+    mirror.picture = None;
+    mirror.pixmap = None;
+
+    round_trips += 2;
+    if (!XGetWindowAttributes(display, mirror.source, &attrs) || attrs.map_state != IsViewable)
+        return;
+
+    mirror.width = attrs.width;
+    mirror.height = attrs.height;
+    mirror.pixmap = XCompositeNameWindowPixmap(display, mirror.source);
+    pa.subwindow_mode = IncludeInferiors;
+    mirror.picture = XRenderCreatePicture(display, mirror.pixmap,
+        XRenderFindVisualFormat(display, attrs.visual), CPSubwindowMode, &pa);
+    XRenderSetPictureFilter(display, mirror.picture, FilterBilinear, NULL, 0);
+
+    mirror_damage(0, 0, mirror.width, mirror.height);
+}
+
+/* Start copying source into the targets added with mirror_add_target().
+ * An offscreen source is not shown itself. */
+static void mirror_start(Window source, bool offscreen) {
+    if (!have_damage)
+        die("Mirroring needs the Composite, Damage and XFixes extensions.");
+
+    mirror.source = source;
+    XCompositeRedirectWindow(
+        display, source, offscreen ? CompositeRedirectManual : CompositeRedirectAutomatic);
+    mirror.damage = XDamageCreate(display, source, XDamageReportBoundingBox);
+    mirror_bind_source();
+}
+
+static void mirror_add_target(struct window *w) {
+    XRenderPictureAttributes pa;
+
+    if (mirror.ntargets == MAX_WINDOWS)
+        return;
+
+    pa.subwindow_mode = ClipByChildren;
+    w->picture = XRenderCreatePicture(
+        display, w->window, XRenderFindVisualFormat(display, w->visual), CPSubwindowMode, &pa);
+    mirror.targets[mirror.ntargets++] = w;
+    mirror_damage(0, 0, mirror.width, mirror.height);
+}
+
+/* Copy the damaged box of the source into every target, scaled to the
+ * target's size by the server. */
+static void mirror_flush() {
+    int i;
+
+    if (!mirror.dirty || !mirror.picture)
+        return;
+
+    /* anything drawn after this is reported again */
+    XDamageSubtract(display, mirror.damage, None, None);
+    mirror.dirty = false;
+
+    for (i = 0; i < mirror.ntargets; i++) {
+        struct window *w = mirror.targets[i];
+        double sx = (double) mirror.width / w->width, sy = (double) mirror.height / w->height;
+        XTransform t = { { { XDoubleToFixed(sx), 0, 0 }, { 0, XDoubleToFixed(sy), 0 },
+            { 0, 0, XDoubleToFixed(1) } } };
+        /* grown by a pixel for the bilinear filter's neighbours */
+        int x1 = mirror.x1 / sx - 1, y1 = mirror.y1 / sy - 1;
+        int x2 = mirror.x2 / sx + 2, y2 = mirror.y2 / sy + 2;
+
+        if (x1 < 0)
+            x1 = 0;
+        if (y1 < 0)
+            y1 = 0;
+        if (x2 > (int) w->width)
+            x2 = w->width;
+        if (y2 > (int) w->height)
+            y2 = w->height;
+
+        XRenderSetPictureTransform(display, mirror.picture, &t);
+        XRenderComposite(display, PictOpSrc, mirror.picture, None, w->picture, x1, y1, 0, 0, x1,
+            y1, x2 - x1, y2 - y1);
+    }
+}
+
+static void mirror_window_resized(struct window *w) {
+    if (!mirror.source)
+        return;
+    if (w->window == mirror.source || w->inner == mirror.source)
+        mirror_bind_source();
+    else if (w->picture)
+        mirror_damage(0, 0, mirror.width, mirror.height);
+}
+#else
+static void mirror_start(Window source, bool offscreen) {
+    die("Mirroring needs xwinwrap built with Xdamage, Xcomposite and Xfixes.");
+}
+
+static void mirror_add_target(struct window *w) {
+}
+#endif
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    while (len--)
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    return hash;
+}
+
+/* $XDG_CACHE_HOME/xwinwrap, or ~/.cache/xwinwrap, created if needed. */
+static char *make_cache_dir() {
+    char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME"), *dir = NULL;
+
+    if (cache && cache[0]) {
+        asprintf(&dir, "%s/" NAME, cache);
+    } else if (home) {
+        asprintf(&dir, "%s/.cache", home);
+        mkdir(dir, 0700);
+        free(dir);
+        asprintf(&dir, "%s/.cache/" NAME, home);
+    }
+    if (dir)
+        mkdir(dir, 0700);
+    return dir;
+}
+
+/* -sh FILE: the shape is the opaque part of a PNG, or the set bits of an
+ * XBM, scaled to the window. It is sent as YX-banded rectangles in a single
+ * ShapeRectangles request, and the rectangles are cached on disk for the
+ * mask and window size, so a large mask is only scanned once. */
+static bool mask_decode(const char *path, const unsigned char *file, size_t len,
+    unsigned int *width, unsigned int *height, unsigned char **pixels, const char **error) {
+    if (len >= 8 && memcmp(file, "\x89PNG", 4) == 0) {
+#ifdef HAVE_PNG
+        png_image png = { .version = PNG_IMAGE_VERSION };
+        unsigned char *ga;
+        unsigned int i;
+        bool alpha;
+
+        if (!png_image_begin_read_from_memory(&png, file, len)) {
+            *error = "the PNG file can't be read";
+            return false;
+        }
+        alpha = png.format & PNG_FORMAT_FLAG_ALPHA;
+        png.format = PNG_FORMAT_GA;
+        ga = malloc(PNG_IMAGE_SIZE(png));
+        if (!ga || !png_image_finish_read(&png, NULL, ga, 0, NULL)) {
+            png_image_free(&png);
+            free(ga);
+            *error = "the PNG file can't be read";
+            return false;
+        }
+        *width = png.width;
+        *height = png.height;
+        *pixels = malloc(*width * *height);
+        /* without an alpha channel the grey level is the mask */
+        for (i = 0; i < *width * *height; i++)
+            (*pixels)[i] = ga[i * 2 + alpha] >= 128;
+        free(ga);
+#else
+        *error = "PNG shapes need xwinwrap built with libpng";
+        return false;
+#endif
+    } else {
+        unsigned char *data;
+        unsigned int x, y, stride;
+        int xhot, yhot;
+
+        if (XReadBitmapFileData(path, width, height, &data, &xhot, &yhot) != BitmapSuccess) {
+            *error = "the mask is neither a PNG nor an XBM file";
+            return false;
+        }
+        stride = (*width + 7) / 8;
+        *pixels = malloc(*width * *height);
+        for (y = 0; y < *height; y++)
+            for (x = 0; x < *width; x++)
+                (*pixels)[y * *width + x] = (data[y * stride + x / 8] >> (x % 8)) & 1;
+        XFree(data);
+    }
+    if (!*pixels) {
+        *error = "the mask is empty or too large";
+        return false;
+    }
+    return true;
+}
+
+/* The runs of set bits in a row packed 64 pixels to a word, as x0, x1
+ * pairs. Only the bits where the row changes are visited. */
+static int mask_runs(const uint64_t *row, unsigned int width, short *runs) {
+    uint64_t carry = 0;
+    unsigned int i, n = 0, words = (width + 63) / 64;
+
+    for (i = 0; i < words; i++) {
+        uint64_t edges = row[i] ^ ((row[i] << 1) | carry);
+
+        carry = row[i] >> 63;
+        while (edges) {
+            unsigned int x = i * 64 + __builtin_ctzll(edges);
+
+            runs[n++] = x < width ? x : width;
+            edges &= edges - 1;
+        }
+    }
+    /* a run up to the last pixel is still open */
+    if (n % 2)
+        runs[n++] = width;
+    return n;
+}
+
+static XRectangle *mask_rectangles(unsigned int width, unsigned int height, int *nrects) {
+    unsigned int words = (width + 63) / 64, x, y, my, prev_my = UINT_MAX, *xmap;
+    uint64_t *row = calloc(words, sizeof(uint64_t));
+    short *runs = malloc((width + 2) * sizeof(short)), *prev = malloc((width + 2) * sizeof(short));
+    XRectangle *rects = NULL;
+    int n = 0, nprev = -1, band = 0, cap = 0, i;
+
+    xmap = malloc(width * sizeof(*xmap));
+    for (x = 0; x < width; x++)
+        xmap[x] = (uint64_t) x * shape_mask.width / width;
+
+    for (y = 0; y < height; y++) {
+        my = (uint64_t) y * shape_mask.height / height;
+        /* the same mask row, when scaling up, gives the same runs */
+        if (my != prev_my) {
+            const unsigned char *src = shape_mask.pixels + (size_t) my * shape_mask.width;
+
+            memset(row, 0, words * sizeof(uint64_t));
+            for (x = 0; x < width; x++)
+                row[x / 64] |= (uint64_t) src[xmap[x]] << (x % 64);
+            n = mask_runs(row, width, runs);
+            prev_my = my;
+        }
+
+        /* a row like the one above grows its band, any other starts one */
+        if (n == nprev && memcmp(runs, prev, n * sizeof(short)) == 0) {
+            for (i = band; i < *nrects; i++)
+                rects[i].height++;
+            continue;
+        }
+        band = *nrects;
+        if (*nrects + n / 2 > cap) {
+            cap = (*nrects + n / 2) * 2;
+            rects = realloc(rects, cap * sizeof(XRectangle));
+        }
+        for (i = 0; i < n; i += 2) {
+            XRectangle *r = &rects[(*nrects)++];
+
+            r->x = runs[i];
+            r->y = y;
+            r->width = runs[i + 1] - runs[i];
+            r->height = 1;
         }
+        memcpy(prev, runs, n * sizeof(short));
+        nprev = n;
+    }
+
+    free(xmap);
+    free(row);
+    free(runs);
+    free(prev);
+    return rects;
+}
+
+static void mask_cache_path(unsigned int width, unsigned int height, char *path, size_t len) {
+    char geometry[32];
+    uint64_t hash;
+
+    snprintf(geometry, sizeof(geometry), "%ux%u", width, height);
+    hash = fnv1a(shape_mask.hash, geometry, strlen(geometry));
+    snprintf(path, len, "%s/%016llx.shape", shape_mask.cache, (unsigned long long) hash);
+}
+
+static void apply_mask(struct window *w) {
+    struct shape_header hdr;
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    XRectangle *rects = NULL;
+    struct stat st;
+    int nrects = 0, fd;
+    FILE *f;
+
+    mask_cache_path(w->width, w->height, path, sizeof(path));
+    if (shape_mask.cache && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        size_t size;
+
+        /* there are never more rectangles than pixels */
+        if (fstat(fd, &st) == 0 && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+            && memcmp(hdr.magic, SHAPE_MAGIC, sizeof(hdr.magic)) == 0
+            && hdr.count <= (uint64_t) w->width * w->height
+            && (size = hdr.count * sizeof(XRectangle)) == st.st_size - sizeof(hdr)
+            && (rects = malloc(size + 1))) {
+            if (read(fd, rects, size) == (ssize_t) size) {
+                nrects = hdr.count;
+            } else {
+                free(rects);
+                rects = NULL;
+            }
+        }
+        close(fd);
+    }
+
+    if (!rects) {
+        rects = mask_rectangles(w->width, w->height, &nrects);
+        memcpy(hdr.magic, SHAPE_MAGIC, sizeof(hdr.magic));
+        hdr.count = nrects;
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        if (shape_mask.cache && (f = fopen(tmp, "wb"))) {
+            bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+                && fwrite(rects, sizeof(XRectangle), nrects, f) == (size_t) nrects;
+
+            if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+                unlink(tmp);
+        }
+    } else if (debug) {
+        fprintf(stderr, NAME ": shape from %s\n", path);
     }
+
+    XShapeCombineRectangles(display, w->window, ShapeBounding, 0, 0, rects, nrects, ShapeSet,
+        YXBanded);
     if (debug)
-        fprintf(stderr, "No ARGB Visual found");
-    XFree(visual_list);
-    return 0;
+        fprintf(stderr, NAME ": shape of %d rectangles for %ux%u\n", nrects, w->width, w->height);
+    free(rects);
 }
 
-static void sig_handler(int sig) {
-    kill(pid, sig);
+/* Switch to the mask in path. It is decoded at once, so a file that is not
+ * a mask leaves the current one in place, with *error saying why. */
+static bool mask_open(const char *path, const char **error) {
+    unsigned char *pixels = NULL;
+    unsigned int width = 0, height = 0;
+    struct stat st;
+    void *file;
+    bool ok;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        *error = "the mask file can't be opened";
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0
+        || (file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        *error = "the mask file can't be read";
+        return false;
+    }
+    close(fd);
+
+    ok = mask_decode(path, file, st.st_size, &width, &height, &pixels, error);
+    if (ok) {
+        free(shape_mask.pixels);
+        free(shape_mask.path);
+        shape_mask.path = strdup(path);
+        shape_mask.hash = fnv1a(0xcbf29ce484222325ULL, file, st.st_size);
+        shape_mask.width = width;
+        shape_mask.height = height;
+        shape_mask.pixels = pixels;
+        if (!shape_mask.cache)
+            shape_mask.cache = make_cache_dir();
+        if (debug)
+            fprintf(stderr, NAME ": loaded %ux%u shape mask %s\n", width, height, path);
+    }
+    munmap(file, st.st_size);
+    return ok;
 }
 
-static void usage() {
-    fprintf(stderr,
-        "Usage: %s [-g {w}x{h}+{x}+{y}] [-ni] [-argb] [-fdt] [-fs] [-s] [-st] [-sp] [-a] [-d] "
-        "[-b] [-nf] [-o OPACITY] [-sh SHAPE] [-ov] -- COMMAND ARG1 ...\n",
-        NAME);
-    fprintf(stderr, "Options:\n \
-            -g      - Specify Geometry (w=width, h=height, x=x-coord, y=y-coord. ex: -g 640x480+100+100)\n \
-            -ni     - Ignore Input\n \
-            -argb   - RGB\n \
-            -fdt    - force WID window a desktop type window\n \
-            -sub    - Set WID placeholder (default is %s)\n \
-            -fs     - Full Screen\n \
-            -un     - Undecorated\n \
-            -s      - Sticky\n \
-            -st     - Skip Taskbar\n \
-            -sp     - Skip Pager\n \
-            -a      - Above\n \
-            -b      - Below\n \
-            -nf     - No Focus\n \
-            -o      - Opacity value between 0 to 1 (ex: -o 0.20)\n \
-            -sh     - Shape of window (choose between rectangle, circle or triangle. Default is rectangle)\n \
-            -ov     - Set override_redirect flag (For seamless desktop background integration in non-fullscreenmode)\n \
-            -d      - Daemonize\n \
-            -fa     - Force the child window to attach (no need to provide it with WID)\n \
-            -debug  - Enable debug messages\n",
-        WID_PLACEHOLDER);
-    exit(1);
+static void apply_shape(struct window *w) {
+    Pixmap mask;
+    GC mask_gc;
+    XGCValues xgcv;
+
+    if (!shape)
+        return;
+    if (shape == SHAPE_MASK) {
+        apply_mask(w);
+        return;
+    }
+
+    mask = XCreatePixmap(display, w->window, w->width, w->height, 1);
+    mask_gc = XCreateGC(display, mask, 0, &xgcv);
+
+    switch (shape) {
+    //Nothing special to be done if it's a rectangle
+    case SHAPE_CIRCLE: {
+        /* fill mask */
+        XSetForeground(display, mask_gc, 0);
+        XFillRectangle(display, mask, mask_gc, 0, 0, w->width, w->height);
+
+        XSetForeground(display, mask_gc, 1);
+        XFillArc(display, mask, mask_gc, 0, 0, w->width, w->height, 0, 23040);
+        break;
+    }
+    case SHAPE_TRIG: {
+        XPoint points[3] = { { 0, w->height }, { w->width / 2, 0 }, { w->width, w->height } };
+
+        XSetForeground(display, mask_gc, 0);
+        XFillRectangle(display, mask, mask_gc, 0, 0, w->width, w->height);
+
+        XSetForeground(display, mask_gc, 1);
+        XFillPolygon(display, mask, mask_gc, points, 3, Complex, CoordModeOrigin);
+        break;
+    }
+    default: break;
+    }
+    /* combine */
+    XShapeCombineMask(display, w->window, ShapeBounding, 0, 0, mask, ShapeSet);
+
+    XFreeGC(display, mask_gc);
+    XFreePixmap(display, mask);
+}
+
+/* A wrapper size with -scale applied, never 0. */
+static unsigned int scaled(unsigned int size) {
+    unsigned int s = size * render_scale + 0.5;
+
+    return s ? s : 1;
+}
+
+/* -scale: the child renders into a smaller window inside the wrapper. It is
+ * redirected offscreen and the wrapper shows it upscaled by the server. */
+static void create_inner(struct window *w) {
+    XSetWindowAttributes attrs;
+
+    attrs.event_mask = StructureNotifyMask | SubstructureNotifyMask;
+    w->inner = XCreateWindow(display, w->window, 0, 0, scaled(w->width), scaled(w->height), 0,
+        CopyFromParent, InputOutput, CopyFromParent, CWEventMask, &attrs);
+    XMapWindow(display, w->inner);
 }
 
-static Window find_subwindow(Window win, int w, int h) {
-    unsigned int i, j;
-    Window troot, parent, *children;
-    unsigned int n;
+/* Move and resize the wrapper in place: the shape mask is rebuilt for the
+ * new size and the child is resized along with it, so it never has to be
+ * restarted. */
+static void resize_window(struct window *w, int x, int y, unsigned int width, unsigned int height) {
+    bool resized = width != w->width || height != w->height;
+
+    if (!resized && x == w->x && y == w->y)
+        return;
+
+    w->x = x;
+    w->y = y;
+    w->width = width;
+    w->height = height;
+    XMoveResizeWindow(display, w->window, x, y, width, height);
+
+    if (!resized)
+        return;
+
+    apply_shape(w);
+
+    if (w->inner != w->window) {
+        width = scaled(width);
+        height = scaled(height);
+        XResizeWindow(display, w->inner, width, height);
+    }
+#ifdef HAVE_XDAMAGE
+    mirror_window_resized(w);
+#endif
+
+    if (w->child) {
+        XConfigureEvent ce;
+
+        XResizeWindow(display, w->child, width, height);
+
+        /* like a window manager, also tell the child its new geometry
+         * directly (ICCCM 4.1.5) */
+        memset(&ce, 0, sizeof(ce));
+        ce.type = ConfigureNotify;
+        ce.display = display;
+        ce.event = w->child;
+        ce.window = w->child;
+        ce.width = width;
+        ce.height = height;
+        ce.above = None;
+        XSendEvent(display, w->child, False, StructureNotifyMask, (XEvent *) &ce);
+    }
+
+    if (debug)
+        fprintf(stderr, NAME ": window resized to %ux%u+%d+%d\n", w->width, w->height, x, y);
+}
+
+#ifdef HAVE_XDAMAGE
+static void rootpmap_resize();
+#endif
+
+static void screen_changed(int width, int height) {
+    /* a hotplug that keeps the screen size leaves a single fullscreen window
+     * as it is, only -per-output windows follow it, in crtc_changed() */
+    if (width == display_width && height == display_height)
+        return;
+
+    display_width = width;
+    display_height = height;
+    if (debug)
+        fprintf(stderr, NAME ": screen size changed to %dx%d\n", width, height);
+
+    /* with -per-output, windows follow their CRTC instead */
+    if (fullscreen && !per_output)
+        resize_window(&window, 0, 0, width, height);
+#ifdef HAVE_XDAMAGE
+    if (rootpmap.pixmap)
+        rootpmap_resize();
+#endif
+}
+
+static void create_wrapper(struct window *w) {
+    int flags = CWOverrideRedirect | CWBackingStore;
+
+    if (override) {
+        /* An override_redirect True window.
+         * No WM hints or button processing needed. */
+        XSetWindowAttributes attrs = { ParentRelative, 0L, 0, 0L, 0, 0, Always, 0L, 0L, False,
+            StructureNotifyMask | SubstructureNotifyMask | ExposureMask, 0L, True, 0, 0 };
+
+        if (have_argb_visual) {
+            attrs.colormap = w->colourmap;
+            flags |= CWBorderPixel | CWColormap;
+        } else {
+            flags |= CWBackPixel;
+        }
+
+        w->window = XCreateWindow(display, w->desktop, w->x, w->y, w->width, w->height, 0, depth,
+            InputOutput, visual, flags, &attrs);
+        trace_phase("create window");
+        XLowerWindow(display, w->window);
+
+        fprintf(stderr, NAME ": window type - override\n");
+        fflush(stderr);
+    } else {
+        XSetWindowAttributes attrs = { ParentRelative, 0L, 0, 0L, 0, 0, Always, 0L, 0L, False,
+            StructureNotifyMask | SubstructureNotifyMask | ExposureMask | ButtonPressMask
+                | ButtonReleaseMask,
+            0L, False, 0, 0 };
+
+        XWMHints wmHint;
+        Atom xa;
+
+        if (have_argb_visual) {
+            attrs.colormap = w->colourmap;
+            flags |= CWBorderPixel | CWColormap;
+        } else {
+            flags |= CWBackPixel;
+        }
+
+        w->window = XCreateWindow(display, w->root, w->x, w->y, w->width, w->height, 0, depth,
+            InputOutput, visual, flags, &attrs);
+        trace_phase("create window");
+
+        wmHint.flags = InputHint | StateHint;
+        // wmHint.input = undecorated ? False : True;
+        wmHint.input = !no_focus;
+        wmHint.initial_state = NormalState;
+
+        XSetWMProperties(display, w->window, NULL, NULL, wm_argv, wm_argc, NULL, &wmHint, NULL);
+
+        xa = ATOM(_NET_WM_WINDOW_TYPE);
+
+        Atom prop;
+        if (set_desktop_type) {
+            prop = ATOM(_NET_WM_WINDOW_TYPE_DESKTOP);
+        } else {
+            prop = ATOM(_NET_WM_WINDOW_TYPE_NORMAL);
+        }
+
+        XChangeProperty(
+            display, w->window, xa, XA_ATOM, 32, PropModeReplace, (unsigned char *) &prop, 1);
+
+        if (undecorated) {
+            long hints[5] = { 2, 0, 0, 0, 0 };
+
+            xa = ATOM(_MOTIF_WM_HINTS);
+            XChangeProperty(
+                display, w->window, xa, xa, 32, PropModeReplace, (unsigned char *) hints, 5);
+        }
+
+        /* Below other windows */
+        if (below) {
+            long layer = 0;
+            Atom state = ATOM(_NET_WM_STATE_BELOW);
+
+            XChangeProperty(display, w->window, ATOM(_WIN_LAYER), XA_CARDINAL, 32,
+                PropModeAppend, (unsigned char *) &layer, 1);
+            XChangeProperty(display, w->window, ATOM(_NET_WM_STATE), XA_ATOM, 32, PropModeAppend,
+                (unsigned char *) &state, 1);
+        }
+
+        /* Above other windows */
+        if (above) {
+            long layer = 6;
+            Atom state = ATOM(_NET_WM_STATE_ABOVE);
+
+            XChangeProperty(display, w->window, ATOM(_WIN_LAYER), XA_CARDINAL, 32,
+                PropModeAppend, (unsigned char *) &layer, 1);
+            XChangeProperty(display, w->window, ATOM(_NET_WM_STATE), XA_ATOM, 32, PropModeAppend,
+                (unsigned char *) &state, 1);
+        }
+
+        /* Sticky */
+        if (sticky) {
+            CARD32 desktop = 0xFFFFFFFF;
+            Atom state = ATOM(_NET_WM_STATE_STICKY);
+
+            XChangeProperty(display, w->window, ATOM(_NET_WM_DESKTOP), XA_CARDINAL, 32,
+                PropModeAppend, (unsigned char *) &desktop, 1);
+            XChangeProperty(display, w->window, ATOM(_NET_WM_STATE), XA_ATOM, 32, PropModeAppend,
+                (unsigned char *) &state, 1);
+        }
+
+        /* Skip taskbar */
+        if (skip_taskbar) {
+            Atom state = ATOM(_NET_WM_STATE_SKIP_TASKBAR);
+
+            XChangeProperty(display, w->window, ATOM(_NET_WM_STATE), XA_ATOM, 32, PropModeAppend,
+                (unsigned char *) &state, 1);
+        }
+
+        /* Skip pager */
+        if (skip_pager) {
+            Atom state = ATOM(_NET_WM_STATE_SKIP_PAGER);
+
+            XChangeProperty(display, w->window, ATOM(_NET_WM_STATE), XA_ATOM, 32, PropModeAppend,
+                (unsigned char *) &state, 1);
+        }
+    }
+
+    if (opacity != OPAQUE)
+        set_window_opacity(w, opacity);
+    trace_phase("hints");
+
+    if (no_input) {
+        Region region;
+
+        region = XCreateRegion();
+        if (region) {
+            XShapeCombineRegion(display, w->window, ShapeInput, 0, 0, region, ShapeSet);
+            XDestroyRegion(region);
+        }
+    }
+
+    apply_shape(w);
+    trace_phase("shape");
+}
+
+static void create_window(struct window *w) {
+    create_wrapper(w);
+    /* without a background, what the last child drew stays when it dies */
+    if (restart_limit)
+        XSetWindowBackgroundPixmap(display, w->window, None);
+    w->inner = w->window;
+    if (render_scale != 1.0)
+        create_inner(w);
+}
+
+static int get_argb_visual(Visual **visual, int *depth) {
+    XVisualInfo visual_template;
+    XVisualInfo *visual_list;
+    int nxvisuals = 0, i;
+
+    visual_template.screen = screen;
+    visual_list = XGetVisualInfo(display, VisualScreenMask, &visual_template, &nxvisuals);
+    for (i = 0; i < nxvisuals; i++) {
+        if (visual_list[i].depth == 32
+            && (visual_list[i].red_mask == 0xff0000 && visual_list[i].green_mask == 0x00ff00
+                && visual_list[i].blue_mask == 0x0000ff)) {
+            *visual = visual_list[i].visual;
+            *depth = visual_list[i].depth;
+            if (debug)
+                fprintf(stderr, "Found ARGB Visual\n");
+            XFree(visual_list);
+            return 1;
+        }
+    }
+    if (debug)
+        fprintf(stderr, "No ARGB Visual found");
+    XFree(visual_list);
+    return 0;
+}
+
+static void watch_fd(int fd, short events, watch_cb cb, void *data) {
+    if (nwatches == MAX_WATCHES)
+        die("Too many file descriptors to watch.");
+    watches[nwatches].fd = fd;
+    watches[nwatches].events = events;
+    watches[nwatches].cb = cb;
+    watches[nwatches].data = data;
+    nwatches++;
+}
+
+static void unwatch_fd(int fd) {
+    int i;
+
+    for (i = 0; i < nwatches; i++) {
+        if (watches[i].fd == fd) {
+            watches[i] = watches[--nwatches];
+            return;
+        }
+    }
+}
+
+/* (Re)arm the timer identified by cb and data to fire once in ms
+ * milliseconds. */
+static void set_timer(timer_cb cb, void *data, uint64_t ms) {
+    int i;
+
+    for (i = 0; i < ntimers; i++)
+        if (timers[i].cb == cb && timers[i].data == data)
+            break;
+    if (i == ntimers) {
+        if (ntimers == MAX_TIMERS)
+            die("Too many timers.");
+        ntimers++;
+    }
+    timers[i].due = now_ms() + ms;
+    timers[i].cb = cb;
+    timers[i].data = data;
+}
+
+static void cancel_timer(timer_cb cb, void *data) {
+    int i;
+
+    for (i = 0; i < ntimers; i++) {
+        if (timers[i].cb == cb && timers[i].data == data) {
+            timers[i] = timers[--ntimers];
+            return;
+        }
+    }
+}
+
+static void run_timers() {
+    uint64_t now = now_ms();
+    int i;
+
+    for (i = 0; i < ntimers; i++) {
+        if (timers[i].due <= now) {
+            struct timer t = timers[i];
+
+            /* callbacks may re-arm themselves */
+            timers[i--] = timers[--ntimers];
+            t.cb(t.data);
+        }
+    }
+}
+
+static int next_timeout() {
+    uint64_t now = now_ms(), due = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < ntimers; i++)
+        if (timers[i].due < due)
+            due = timers[i].due;
+
+    if (due == UINT64_MAX)
+        return -1;
+    return due > now ? (int) (due - now) : 0;
+}
+
+/* -image: a built-in player for animated GIFs. Every frame is decoded once
+ * and uploaded once into a server-side pixmap, playback is a timer driven
+ * XCopyArea() into the window. */
+
+#define GIF_MAX_CODES 4096
+
+struct gif {
+    const unsigned char *data, *end;
+    unsigned int width, height;
+    uint32_t global_colours[256];
+    int nglobal_colours;
+    int background;
+    int loops;
+
+    /* graphic control extension of the next frame */
+    int disposal;
+    int transparent;
+    unsigned int delay;
+};
+
+struct gif_frame {
+    const uint32_t *canvas;
+    unsigned int delay;
+};
+
+static bool gif_read(struct gif *g, void *buf, size_t len) {
+    if ((size_t) (g->end - g->data) < len)
+        return false;
+    if (buf)
+        memcpy(buf, g->data, len);
+    g->data += len;
+    return true;
+}
+
+static int gif_byte(struct gif *g) {
+    return g->data < g->end ? *g->data++ : -1;
+}
+
+static unsigned int gif_u16(const unsigned char *p) {
+    return p[0] | p[1] << 8;
+}
+
+/* Read a colour table of n entries, returns how many there were. */
+static int gif_colours(struct gif *g, uint32_t *table, int n) {
+    int i;
+
+    for (i = 0; i < n && g->data + 3 <= g->end; i++, g->data += 3)
+        table[i] = 0xff000000 | g->data[0] << 16 | g->data[1] << 8 | g->data[2];
+    return i;
+}
+
+static bool gif_skip_blocks(struct gif *g) {
+    int len;
+
+    while ((len = gif_byte(g)) > 0)
+        if (!gif_read(g, NULL, len))
+            return false;
+    return len == 0;
+}
+
+/* Decode the LZW image data following an image descriptor into indices,
+ * *ndecoded of them. */
+static bool gif_lzw(struct gif *g, unsigned char *out, size_t npixels, size_t *ndecoded) {
+    static uint16_t prefix[GIF_MAX_CODES];
+    static unsigned char suffix[GIF_MAX_CODES], stack[GIF_MAX_CODES + 1];
+    int min_size = gif_byte(g), size, clear, eoi, next, prev = -1, first = 0;
+    unsigned int bits = 0, nbits = 0;
+    size_t n = 0;
+    int block = 0;
+
+    if (min_size < 2 || min_size > 11)
+        return false;
+
+    clear = 1 << min_size;
+    eoi = clear + 1;
+    size = min_size + 1;
+    next = clear + 2;
+
+    for (;;) {
+        int code, c, sp = 0;
+
+        while (nbits < (unsigned int) size) {
+            int byte;
+
+            if (block == 0 && (block = gif_byte(g)) <= 0)
+                goto done;
+            /* a truncated file still shows what it has */
+            if ((byte = gif_byte(g)) < 0)
+                goto done;
+            block--;
+            bits |= byte << nbits;
+            nbits += 8;
+        }
+        code = bits & ((1 << size) - 1);
+        bits >>= size;
+        nbits -= size;
+
+        if (code == clear) {
+            size = min_size + 1;
+            next = clear + 2;
+            prev = -1;
+            continue;
+        }
+        if (code == eoi)
+            break;
+
+        if (prev < 0) {
+            if (code >= clear)
+                return false;
+            first = code;
+            if (n < npixels)
+                out[n++] = code;
+            prev = code;
+            continue;
+        }
+
+        c = code;
+        if (code >= next) {
+            if (code > next)
+                return false;
+            stack[sp++] = first;
+            c = prev;
+        }
+        while (c >= clear) {
+            stack[sp++] = suffix[c];
+            c = prefix[c];
+        }
+        stack[sp++] = c;
+        first = c;
+
+        if (next < GIF_MAX_CODES) {
+            prefix[next] = prev;
+            suffix[next] = first;
+            next++;
+            if (next == 1 << size && size < 12)
+                size++;
+        }
+        prev = code;
+
+        while (sp > 0 && n < npixels)
+            out[n++] = stack[--sp];
+    }
+
+    /* skip what is left of the data sub-blocks, a truncated file ends with
+     * this frame */
+    if ((block > 0 && !gif_read(g, NULL, block)) || !gif_skip_blocks(g))
+        g->data = g->end;
+
+done:
+    *ndecoded = n;
+    return true;
+}
+
+static bool gif_open(struct gif *g, const unsigned char *data, size_t len) {
+    unsigned char hdr[13];
+
+    memset(g, 0, sizeof(*g));
+    g->data = data;
+    g->end = data + len;
+    g->transparent = -1;
+    g->loops = -1;
+
+    if (!gif_read(g, hdr, sizeof(hdr)) || memcmp(hdr, "GIF", 3) != 0)
+        return false;
+
+    g->width = gif_u16(hdr + 6);
+    g->height = gif_u16(hdr + 8);
+    g->background = hdr[11];
+    if (hdr[10] & 0x80) {
+        g->nglobal_colours = gif_colours(g, g->global_colours, 2 << (hdr[10] & 7));
+    }
+
+    return g->width > 0 && g->height > 0;
+}
+
+/* Walk all frames, calling cb with the composed canvas of each. A broken
+ * file ends at the last complete frame. Returns the number of frames. */
+static int gif_decode(struct gif *g, void (*cb)(struct gif_frame *, void *), void *ctx) {
+    size_t npixels = (size_t) g->width * g->height;
+    uint32_t *canvas = calloc(npixels, sizeof(uint32_t));
+    uint32_t *saved = NULL;
+    unsigned char *indices = NULL;
+    int nframes = 0, c;
+
+    while ((c = gif_byte(g)) >= 0 && c != 0x3b) {
+        if (c == 0x21) {
+            int label = gif_byte(g), len;
+            unsigned char ext[256];
+
+            if ((len = gif_byte(g)) < 0 || !gif_read(g, ext, len))
+                break;
+            if (label == 0xf9 && len >= 4) {
+                g->disposal = (ext[0] >> 2) & 7;
+                g->transparent = ext[0] & 1 ? ext[3] : -1;
+                g->delay = gif_u16(ext + 1) * 10;
+            } else if (label == 0xff && len == 11 && memcmp(ext, "NETSCAPE2.0", 11) == 0) {
+                unsigned char sub[3];
+
+                if (gif_byte(g) == 3 && gif_read(g, sub, 3))
+                    g->loops = gif_u16(sub + 1);
+            }
+            if (!gif_skip_blocks(g))
+                break;
+        } else if (c == 0x2c) {
+            unsigned char desc[9];
+            uint32_t local_colours[256] = { 0 }, *colours = g->global_colours;
+            int ncolours = g->nglobal_colours;
+            unsigned int x, y, fx, fy, fw, fh, row;
+            size_t ndecoded;
+            bool interlaced;
+            struct gif_frame frame;
+
+            if (!gif_read(g, desc, sizeof(desc)))
+                break;
+            fx = gif_u16(desc);
+            fy = gif_u16(desc + 2);
+            fw = gif_u16(desc + 4);
+            fh = gif_u16(desc + 6);
+            interlaced = desc[8] & 0x40;
+            if (desc[8] & 0x80) {
+                ncolours = gif_colours(g, local_colours, 2 << (desc[8] & 7));
+                colours = local_colours;
+            }
+
+            indices = realloc(indices, (size_t) fw * fh + 1);
+            if (!gif_lzw(g, indices, (size_t) fw * fh, &ndecoded))
+                break;
+
+            if (g->disposal == 3) {
+                if (!saved)
+                    saved = malloc(npixels * sizeof(uint32_t));
+                memcpy(saved, canvas, npixels * sizeof(uint32_t));
+            }
+
+            for (row = 0; row < fh; row++) {
+                /* interlaced rows come in passes of every 8th, 8th, 4th and
+                 * 2nd row */
+                y = row;
+                if (interlaced) {
+                    unsigned int p1 = (fh + 7) / 8, p2 = (fh + 3) / 8, p3 = (fh + 1) / 4;
+
+                    if (row < p1)
+                        y = row * 8;
+                    else if (row < p1 + p2)
+                        y = (row - p1) * 8 + 4;
+                    else if (row < p1 + p2 + p3)
+                        y = (row - p1 - p2) * 4 + 2;
+                    else
+                        y = (row - p1 - p2 - p3) * 2 + 1;
+                }
+                if (fy + y >= g->height)
+                    continue;
+                /* a short frame leaves the remaining pixels untouched,
+                 * like transparent ones and those outside the palette */
+                for (x = 0; x < fw && fx + x < g->width && row * fw + x < ndecoded; x++) {
+                    int index = indices[row * fw + x];
+
+                    if (index != g->transparent && index < ncolours)
+                        canvas[(fy + y) * g->width + fx + x] = colours[index];
+                }
+            }
+
+            frame.canvas = canvas;
+            frame.delay = g->delay;
+            cb(&frame, ctx);
+            nframes++;
+
+            /* dispose before the next frame */
+            if (g->disposal == 2) {
+                for (y = fy; y < fy + fh && y < g->height; y++)
+                    for (x = fx; x < fx + fw && x < g->width; x++)
+                        canvas[y * g->width + x] = 0;
+            } else if (g->disposal == 3 && saved) {
+                memcpy(canvas, saved, npixels * sizeof(uint32_t));
+            }
+            g->disposal = 0;
+            g->transparent = -1;
+            g->delay = 0;
+        } else {
+            break;
+        }
+    }
+
+    free(canvas);
+    free(saved);
+    free(indices);
+
+    return nframes;
+}
+
+static void image_channel(unsigned long mask, int channel) {
+    image.shift[channel] = 0;
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        image.shift[channel]++;
+    }
+    image.bits[channel] = __builtin_popcountl(mask);
+}
+
+/* Pixel value in the window's visual, premultiplied on ARGB visuals. */
+static uint32_t image_pixel(uint32_t argb) {
+    uint32_t pixel = 0, a = argb >> 24;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        uint32_t c = (argb >> (16 - 8 * i)) & 0xff;
+
+        if (have_argb_visual)
+            c = c * a / 255;
+        c = image.bits[i] >= 8 ? c << (image.bits[i] - 8) : c >> (8 - image.bits[i]);
+        pixel |= c << image.shift[i];
+    }
+    if (have_argb_visual)
+        pixel |= a << 24;
+    return pixel;
+}
+
+/* Upload a rectangle of a composed canvas into a new pixmap. */
+static Pixmap image_upload(const uint32_t *canvas, int x, int y, unsigned int width,
+    unsigned int height) {
+    uint32_t *pixels = malloc((size_t) width * height * sizeof(uint32_t));
+    unsigned int i, j;
+    uint16_t one = 1;
+    XImage *img;
+    Pixmap pixmap;
+
+    for (j = 0; j < height; j++)
+        for (i = 0; i < width; i++)
+            pixels[j * width + i] = image_pixel(canvas[(y + j) * image.width + x + i]);
+
+    img = XCreateImage(display, window.visual, image.depth, ZPixmap, 0, (char *) pixels, width,
+        height, 32, 0);
+    if (!img || img->bits_per_pixel != 32)
+        die("-image needs a visual with 32 bits per pixel.");
+    /* the pixels are in host order, Xlib swaps them if the server differs */
+    img->byte_order = *(char *) &one ? LSBFirst : MSBFirst;
+
+    pixmap = XCreatePixmap(display, window.window, width, height, image.depth);
+    XPutImage(display, pixmap, image.gc, img, 0, 0, 0, 0, width, height);
+    XDestroyImage(img);
+
+    image.bytes += (size_t) width * height * 4;
+    return pixmap;
+}
+
+struct image_load {
+    bool deltas;
+    int keyframe; /* the first frame once over the budget */
+    uint32_t *previous;
+};
+
+static void image_add_frame(struct gif_frame *frame, void *ctx) {
+    struct image_load *load = ctx;
+    size_t frame_bytes = (size_t) image.width * image.height * 4;
+    unsigned int x, y, x1 = image.width, y1 = image.height, x2 = 0, y2 = 0;
+    struct image_frame *f;
+
+    if (image.nframes % 16 == 0)
+        image.frames = realloc(image.frames, (image.nframes + 16) * sizeof(struct image_frame));
+    f = &image.frames[image.nframes];
+
+    /* over budget, keep only every IMAGE_KEYFRAME_INTERVAL-th frame from
+     * here on whole and the changed area of the others */
+    if (!load->deltas && image.nframes && image.bytes + frame_bytes > image_budget) {
+        load->deltas = true;
+        load->keyframe = image.nframes;
+        load->previous = malloc(frame_bytes);
+        image.canvas
+            = XCreatePixmap(display, window.window, image.width, image.height, image.depth);
+        image.bytes += frame_bytes;
+    }
+
+    f->delay = frame->delay > 10 ? frame->delay : 100;
+    f->x = 0;
+    f->y = 0;
+    f->width = image.width;
+    f->height = image.height;
+    f->pixmap = None;
+
+    if (!load->deltas || (image.nframes - load->keyframe) % IMAGE_KEYFRAME_INTERVAL == 0) {
+        f->pixmap = image_upload(frame->canvas, 0, 0, image.width, image.height);
+    } else {
+        /* only the bounding box of what changed since the previous frame */
+        for (y = 0; y < image.height; y++) {
+            for (x = 0; x < image.width; x++) {
+                size_t i = (size_t) y * image.width + x;
+
+                if (frame->canvas[i] == load->previous[i])
+                    continue;
+                if (x < x1)
+                    x1 = x;
+                if (x > x2)
+                    x2 = x;
+                if (y < y1)
+                    y1 = y;
+                if (y > y2)
+                    y2 = y;
+            }
+        }
+        f->width = f->height = 0;
+        if (x1 <= x2 && y1 <= y2) {
+            f->x = x1;
+            f->y = y1;
+            f->width = x2 - x1 + 1;
+            f->height = y2 - y1 + 1;
+            f->pixmap = image_upload(frame->canvas, f->x, f->y, f->width, f->height);
+        }
+    }
+
+    if (load->deltas)
+        memcpy(load->previous, frame->canvas, frame_bytes);
+    image.nframes++;
+}
+
+static void image_load(const char *path) {
+    struct image_load load = { false, 0, NULL };
+    unsigned char *data;
+    struct stat st;
+    struct gif g;
+    FILE *f;
+    XGCValues gcv;
+
+    if (!(f = fopen(path, "rb")) || fstat(fileno(f), &st) < 0)
+        die("Couldn't open %s:", path);
+    data = malloc(st.st_size);
+    if (fread(data, 1, st.st_size, f) != (size_t) st.st_size)
+        die("Couldn't read %s:", path);
+    fclose(f);
+
+    if (window.visual->class != TrueColor)
+        die("-image needs a TrueColor visual.");
+    image_channel(window.visual->red_mask, 0);
+    image_channel(window.visual->green_mask, 1);
+    image_channel(window.visual->blue_mask, 2);
+    image.depth = have_argb_visual ? 32 : DefaultDepth(display, screen);
+    gcv.graphics_exposures = False;
+    image.gc = XCreateGC(display, window.window, GCGraphicsExposures, &gcv);
+
+    if (!gif_open(&g, data, st.st_size))
+        die("%s is not a GIF image.", path);
+    image.width = g.width;
+    image.height = g.height;
+    /* a single pass, frames are uploaded as they are decoded */
+    if (gif_decode(&g, image_add_frame, &load) == 0)
+        die("%s is not a GIF image.", path);
+    image.loops = g.loops;
+    free(load.previous);
+    free(data);
+    trace_phase("image");
+
+    if (debug)
+        fprintf(stderr, NAME ": %s: %ux%u, %d frames, %zu KiB of pixmaps%s\n", path, image.width,
+            image.height, image.nframes, image.bytes / 1024, load.deltas ? " (deltas)" : "");
+}
+
+/* Copy the current frame, or the part of it in x, y, width, height, to the
+ * windows. */
+static void image_draw(struct window *w, int x, int y, unsigned int width, unsigned int height) {
+    Drawable src = image.canvas ? image.canvas : image.frames[image.current].pixmap;
+
+    XCopyArea(display, src, w->window, image.gc, x, y, width, height,
+        ((int) w->width - (int) image.width) / 2 + x,
+        ((int) w->height - (int) image.height) / 2 + y);
+}
+
+static void image_show_frame(int n) {
+    struct image_frame *f = &image.frames[n];
+    int i;
+
+    image.current = n;
+    if (image.canvas && f->pixmap)
+        XCopyArea(display, f->pixmap, image.canvas, image.gc, 0, 0, f->width, f->height, f->x,
+            f->y);
+    if (!f->pixmap)
+        return;
+    for (i = 0; i < nwindows; i++)
+        image_draw(windows[i], f->x, f->y, f->width, f->height);
+}
+
+static void on_image_timer(void *data) {
+    int next = image.current + 1;
+
+    if (next == image.nframes) {
+        /* without a NETSCAPE loop count the animation plays once, 0 loops
+         * forever */
+        if (image.loops < 0 || (image.loops > 0 && ++image.played > image.loops))
+            return;
+        next = 0;
+    }
+    image_show_frame(next);
+    set_timer(on_image_timer, NULL, image.frames[next].delay);
+}
+
+/* Whether a child would be stopped in every window. */
+static bool windows_paused() {
+    int i;
+
+    for (i = 0; i < nwindows; i++)
+        if (!windows[i]->paused)
+            return false;
+    return true;
+}
+
+/* The animation runs while any window would let a child run. */
+static void image_update_playing() {
+    bool playing = !windows_paused();
+
+    /* a still image is drawn once */
+    if (image.nframes < 2)
+        return;
+
+    if (playing == image.playing)
+        return;
+    image.playing = playing;
+    if (playing)
+        set_timer(on_image_timer, NULL, image.frames[image.current].delay);
+    else
+        cancel_timer(on_image_timer, NULL);
+    if (debug)
+        fprintf(stderr, NAME ": image %s\n", playing ? "continued" : "stopped");
+}
+
+/* -stream: raw frames are read from a pipe straight into shared memory
+ * segments and put to the windows with XShmPutImage. The buffers are used
+ * in turn, a frame is only put once the server has completed the previous
+ * one, and reading stops while no buffer is free, which paces the
+ * producer. */
+static void stream_put(struct window *w, int n) {
+    XShmPutImage(display, w->window, stream.gc, stream.images[n], 0, 0,
+        ((int) w->width - (int) stream.width) / 2, ((int) w->height - (int) stream.height) / 2,
+        stream.width, stream.height, True);
+    stream.pending++;
+}
+
+static void on_stream_read(int fd, short revents, void *data) {
+    while (stream.reading) {
+        ssize_t n = read(fd, stream.images[stream.fill]->data + stream.filled,
+            stream.frame_size - stream.filled);
+
+        if (n == 0) {
+            if (debug)
+                fprintf(stderr, NAME ": end of stream\n");
+            unwatch_fd(fd);
+            stream.reading = false;
+            running = false;
+            return;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            die("Couldn't read the stream:");
+        }
+
+        stream.filled += n;
+        if (stream.filled < stream.frame_size)
+            continue;
+
+        stream.state[stream.fill] = STREAM_READY;
+        stream.filled = 0;
+        stream.fill = (stream.fill + 1) % STREAM_BUFFERS;
+        if (stream.state[stream.fill] == STREAM_FREE) {
+            stream.state[stream.fill] = STREAM_FILLING;
+        } else {
+            unwatch_fd(fd);
+            stream.reading = false;
+        }
+    }
+}
+
+/* Called once per loop iteration: show the next frame if the server is done
+ * with the last one, and resume reading into a freed buffer. */
+static void stream_flush() {
+    int next = (stream.shown + 1) % STREAM_BUFFERS, i;
+
+    if (!stream.images[0])
+        return;
+
+    if (stream.pending == 0 && stream.state[next] == STREAM_READY && !windows_paused()) {
+        if (stream.state[stream.shown] == STREAM_SHOWN)
+            stream.state[stream.shown] = STREAM_FREE;
+        stream.shown = next;
+        stream.state[next] = STREAM_SHOWN;
+        for (i = 0; i < nwindows; i++)
+            stream_put(windows[i], next);
+    }
+
+    if (!stream.reading && stream.state[stream.fill] == STREAM_FREE) {
+        stream.state[stream.fill] = STREAM_FILLING;
+        stream.reading = true;
+        watch_fd(stream.fd, POLLIN, on_stream_read, NULL);
+    }
+}
+
+static void stream_open(const char *path, const char *size) {
+    Visual *v = window.visual;
+    int i, shm_major, shm_minor;
+    Bool shm_pixmaps;
+
+    if (sscanf(size, "%ux%u", &stream.width, &stream.height) != 2 || !stream.width
+        || !stream.height)
+        die("-stream-size needs WIDTHxHEIGHT.");
+
+    round_trips += 2;
+    if (!XShmQueryExtension(display)
+        || !XShmQueryVersion(display, &shm_major, &shm_minor, &shm_pixmaps))
+        die("-stream needs the MIT-SHM extension.");
+    /* frames are BGRA bytes, which is a 32 bit pixel in LSBFirst order */
+    if (v->red_mask != 0xff0000 || v->green_mask != 0xff00 || v->blue_mask != 0xff
+        || ImageByteOrder(display) != LSBFirst)
+        die("-stream needs an 8 bit per channel TrueColor visual on a LSBFirst server.");
+
+    if (strcmp(path, "-") == 0) {
+        /* reopened, as O_NONBLOCK on stdin would change it for every process
+         * sharing it; only a socket cannot be, it is switched back at exit */
+        stream.fd = open("/proc/self/fd/0", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (stream.fd < 0) {
+            stream.fd = STDIN_FILENO;
+            stream.stdin_flags = fcntl(stream.fd, F_GETFL);
+            fcntl(stream.fd, F_SETFL, stream.stdin_flags | O_NONBLOCK);
+        }
+    } else if ((stream.fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        die("Couldn't open %s:", path);
+    }
+
+    stream.gc = XCreateGC(display, window.window, 0, NULL);
+    stream.completion = XShmGetEventBase(display) + ShmCompletion;
+
+    for (i = 0; i < STREAM_BUFFERS; i++) {
+        XShmSegmentInfo *shm = &stream.shm[i];
+        XImage *img = XShmCreateImage(display, v,
+            have_argb_visual ? 32 : DefaultDepth(display, screen), ZPixmap, NULL, shm,
+            stream.width, stream.height);
+
+        if (!img || img->bits_per_pixel != 32 || img->bytes_per_line != (int) stream.width * 4)
+            die("-stream needs a visual with 32 bits per pixel.");
+        stream.frame_size = (size_t) img->bytes_per_line * img->height;
+
+        shm->shmid = shmget(IPC_PRIVATE, stream.frame_size, IPC_CREAT | 0600);
+        if (shm->shmid < 0)
+            die("shmget failed:");
+        shm->shmaddr = img->data = shmat(shm->shmid, NULL, 0);
+        if (shm->shmaddr == (void *) -1)
+            die("shmat failed:");
+        shm->readOnly = True;
+        XShmAttach(display, shm);
+        stream.images[i] = img;
+    }
+
+    /* once the server has attached them, the segments go away with the last
+     * user */
+    round_trips++;
+    XSync(display, False);
+    for (i = 0; i < STREAM_BUFFERS; i++)
+        shmctl(stream.shm[i].shmid, IPC_RMID, NULL);
+
+    stream.shown = STREAM_BUFFERS - 1;
+    trace_phase("stream");
+}
+
+static void set_paused(struct window *w, unsigned int reason, bool paused) {
+    unsigned int old = w->paused;
+
+    if (paused)
+        w->paused |= reason;
+    else
+        w->paused &= ~reason;
+
+    if (!old == !w->paused)
+        return;
+    if (image.nframes)
+        image_update_playing();
+    if (w->pid <= 0)
+        return;
+
+    kill(-w->pid, w->paused ? SIGSTOP : SIGCONT);
+    if (debug)
+        fprintf(stderr, NAME ": child %d %s\n", w->pid, w->paused ? "stopped" : "continued");
+}
+
+/* A copy of what the wrapper shows, the child's window included. */
+static Pixmap copy_window(struct window *w) {
+    XGCValues gcv;
+    GC gc;
+    Pixmap pixmap;
+    int depth = have_argb_visual ? 32 : DefaultDepth(display, screen);
+
+    pixmap = XCreatePixmap(display, w->window, w->width, w->height, depth);
+    gcv.subwindow_mode = IncludeInferiors;
+    gcv.graphics_exposures = False;
+    gc = XCreateGC(display, pixmap, GCSubwindowMode | GCGraphicsExposures, &gcv);
+    XCopyArea(display, w->window, pixmap, gc, 0, 0, w->width, w->height, 0, 0);
+    XFreeGC(display, gc);
+    return pixmap;
+}
+
+/* The background the wrapper was created with, see create_window(). */
+static void reset_background(struct window *w) {
+    if (have_argb_visual || restart_limit)
+        XSetWindowBackgroundPixmap(display, w->window, None);
+    else
+        XSetWindowBackground(display, w->window, 0);
+}
+
+/* -snapshot: the last frame of each window is kept in the cache directory,
+ * in a file named after a hash of the command and the geometry. It is the
+ * header followed by the pixels as XGetImage() returns them, so it can be
+ * put from the mapped file as it is. */
+static void snapshot_path(struct window *w, char *path, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    char geometry[64];
+    int i;
+
+    for (i = 0; i < child_argc; i++)
+        hash = fnv1a(hash, child_argv[i], strlen(child_argv[i]) + 1);
+    snprintf(geometry, sizeof(geometry), "%ux%u+%d+%d", w->width, w->height, w->x, w->y);
+    hash = fnv1a(hash, geometry, strlen(geometry));
+    snprintf(path, len, "%s/%016llx.snap", snapshot_dir, (unsigned long long) hash);
+}
+
+static void snapshot_save(struct window *w) {
+    struct snapshot_header hdr = { SNAPSHOT_MAGIC };
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    Pixmap pixmap;
+    XImage *img;
+    FILE *f;
+
+    /* a covered or stopped window has nothing worth keeping */
+    if (!w->drawn || w->paused)
+        return;
+#ifdef HAVE_XDAMAGE
+    /* nor has one that did not draw since, which is not even read back */
+    if (w->damage) {
+        if (!w->snapshot_damaged)
+            return;
+        w->snapshot_damaged = false;
+        XDamageSubtract(display, w->damage, None, None);
+    }
+#endif
+
+    pixmap = copy_window(w);
+    round_trips++;
+    img = XGetImage(display, pixmap, 0, 0, w->width, w->height, AllPlanes, ZPixmap);
+    XFreePixmap(display, pixmap);
+    if (!img)
+        return;
+
+    hdr.width = img->width;
+    hdr.height = img->height;
+    hdr.depth = img->depth;
+    hdr.stride = img->bytes_per_line;
+    hdr.hash = fnv1a(0xcbf29ce484222325ULL, img->data, (size_t) img->bytes_per_line * img->height);
+    if (hdr.hash == w->snapshot_hash) {
+        XDestroyImage(img);
+        return;
+    }
+
+    snapshot_path(w, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((f = fopen(tmp, "wb"))) {
+        bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+            && fwrite(img->data, hdr.stride, hdr.height, f) == hdr.height;
+
+        /* replaced at once, a reader never sees half a file */
+        if (fclose(f) == 0 && ok && rename(tmp, path) == 0)
+            w->snapshot_hash = hdr.hash;
+        else
+            unlink(tmp);
+    }
+    XDestroyImage(img);
+    if (debug)
+        fprintf(stderr, NAME ": saved snapshot %s\n", path);
+}
+
+static void on_snapshot_timer(void *data) {
+    snapshot_save(data);
+    set_timer(on_snapshot_timer, data, SNAPSHOT_INTERVAL);
+}
+
+/* Show the snapshot of the last run as the background until the child
+ * draws. */
+static void snapshot_load(struct window *w) {
+    struct snapshot_header *hdr;
+    char path[PATH_MAX];
+    struct stat st;
+    XImage *img;
+    Pixmap pixmap;
+    void *map;
+    int fd;
+
+    snapshot_path(w, path, sizeof(path));
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    /* still in use, see snapshot_prune() */
+    futimens(fd, NULL);
+    close(fd);
+
+    hdr = map;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 || hdr->width != w->width
+        || hdr->height != w->height
+        || (int) hdr->depth != (have_argb_visual ? 32 : DefaultDepth(display, screen))
+        || (size_t) st.st_size < sizeof(*hdr) + (size_t) hdr->stride * hdr->height) {
+        munmap(map, st.st_size);
+        return;
+    }
+
+    img = XCreateImage(display, w->visual, hdr->depth, ZPixmap, 0, (char *) (hdr + 1),
+        hdr->width, hdr->height, 32, hdr->stride);
+    if (img) {
+        GC gc;
+
+        pixmap = XCreatePixmap(display, w->window, hdr->width, hdr->height, hdr->depth);
+        gc = XCreateGC(display, pixmap, 0, NULL);
+        XPutImage(display, pixmap, gc, img, 0, 0, 0, 0, hdr->width, hdr->height);
+        XFreeGC(display, gc);
+        XSetWindowBackgroundPixmap(display, w->window, pixmap);
+        XFreePixmap(display, pixmap);
+        /* the pixels belong to the mapping */
+        img->data = NULL;
+        XDestroyImage(img);
+        w->snapshot_hash = hdr->hash;
+        if (debug)
+            fprintf(stderr, NAME ": showing snapshot %s\n", path);
+    }
+    munmap(map, st.st_size);
+}
+
+/* Snapshots of commands or geometries that have not run for
+ * SNAPSHOT_MAX_AGE are removed, the others are touched whenever loaded. */
+static void snapshot_prune() {
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    time_t now = time(NULL);
+    DIR *dir;
+
+    if (!(dir = opendir(snapshot_dir)))
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+
+        if (len < 5 || strcmp(de->d_name + len - 5, ".snap") != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", snapshot_dir, de->d_name);
+        if (stat(path, &st) == 0 && now - st.st_mtime > SNAPSHOT_MAX_AGE && unlink(path) == 0
+            && debug)
+            fprintf(stderr, NAME ": removed unused snapshot %s\n", path);
+    }
+    closedir(dir);
+}
+
+/* The child drew its first frame: report the time to it, drop the snapshot
+ * background and keep a new one from now on. */
+static void child_drew(struct window *w) {
+    if (w->drawn)
+        return;
+    w->drawn = true;
+    if (debug)
+        fprintf(stderr, NAME ": first frame %.1f ms after start\n",
+            (now_us() - trace_start) / 1000.0);
+    if (snapshot_dir) {
+        reset_background(w);
+        set_timer(on_snapshot_timer, w, SNAPSHOT_INTERVAL);
+    }
+}
+
+/* Stop the child of w, keeping its last frame as the wrapper's background.
+ * The child window is unmapped, so the server repaints exposures without
+ * it. */
+static void freeze(struct window *w) {
+    Pixmap snapshot;
+
+    if (!w->child || (w->paused & PAUSE_FROZEN))
+        return;
+
+    snapshot = copy_window(w);
+    XSetWindowBackgroundPixmap(display, w->window, snapshot);
+    XFreePixmap(display, snapshot);
+
+    XUnmapWindow(display, w->child);
+    set_paused(w, PAUSE_FROZEN, true);
+    if (debug)
+        fprintf(stderr, NAME ": child window %lx frozen\n", w->child);
+}
+
+#ifdef HAVE_XDAMAGE
+/* -freeze: a child whose window has not been damaged for freeze_ms is
+ * frozen. Damage is only looked at once per interval, the child causes at
+ * most one event in between. */
+static void on_freeze_timer(void *data) {
+    struct window *w = data;
+
+    /* the child is gone, watch_damage() starts over with its next window */
+    if (!w->damage)
+        return;
+
+    /* a child stopped for another reason draws nothing either, one that is
+     * only slowed down still does */
+    if (w->damaged || (w->paused & ~(PAUSE_FPS | PAUSE_IDLE | PAUSE_BACKOFF))) {
+        w->damaged = false;
+        XDamageSubtract(display, w->damage, None, None);
+        set_timer(on_freeze_timer, w, freeze_ms);
+        return;
+    }
+
+    freeze(w);
+}
+#endif
+
+static void thaw(struct window *w) {
+    if (!(w->paused & PAUSE_FROZEN))
+        return;
+
+    if (w->child)
+        XMapWindow(display, w->child);
+    reset_background(w);
+    set_paused(w, PAUSE_FROZEN, false);
+
+#ifdef HAVE_XDAMAGE
+    if (w->damage) {
+        w->damaged = false;
+        XDamageSubtract(display, w->damage, None, None);
+        if (freeze_ms)
+            set_timer(on_freeze_timer, w, freeze_ms);
+    }
+#endif
+    if (debug)
+        fprintf(stderr, NAME ": child window %lx thawed\n", w->child);
+}
+
+#ifdef HAVE_XDAMAGE
+/* -max-fps: the child runs for duty of every 1 / max_fps seconds. Each
+ * FPS_WINDOW the frames it produced are counted from damage events and the
+ * duty cycle is corrected by the ratio of the cap to the measured rate. */
+static void on_fps_duty(void *data) {
+    struct window *w = data;
+    double period = 1000.0 / max_fps;
+    bool stop = !(w->paused & PAUSE_FPS) && w->duty < 1;
+
+    set_paused(w, PAUSE_FPS, stop);
+    set_timer(on_fps_duty, w, (stop ? 1 - w->duty : w->duty) * period + 0.5);
+}
+
+static void on_fps_window(void *data) {
+    struct window *w = data;
+    double fps = w->frames * 1000.0 / FPS_WINDOW;
+
+    /* no frames says nothing about the rate the child could reach */
+    if (w->frames) {
+        /* halfway to the correction, damage counts are noisy */
+        w->duty = (w->duty + w->duty * max_fps / fps) / 2;
+        if (w->duty < FPS_MIN_DUTY)
+            w->duty = FPS_MIN_DUTY;
+        if (w->duty > 1)
+            w->duty = 1;
+    }
+    if (debug)
+        fprintf(stderr, NAME ": child window %lx at %.1f fps, running %.0f%% of the time\n",
+            w->child, fps, w->duty * 100);
+
+    w->frames = 0;
+    set_timer(on_fps_window, w, FPS_WINDOW);
+}
+
+/* Point _XROOTPMAP_ID and ESETROOT_PMAP_ID on the root and desktop windows
+ * to pixmap, or remove them. */
+static void rootpmap_publish(Pixmap pixmap) {
+    Window targets[2] = { window.root, window.desktop };
+    int i;
+
+    for (i = 0; i < (window.desktop != window.root ? 2 : 1); i++) {
+        if (pixmap) {
+            XChangeProperty(display, targets[i], ATOM(_XROOTPMAP_ID), XA_PIXMAP, 32,
+                PropModeReplace, (unsigned char *) &pixmap, 1);
+            XChangeProperty(display, targets[i], ATOM(ESETROOT_PMAP_ID), XA_PIXMAP, 32,
+                PropModeReplace, (unsigned char *) &pixmap, 1);
+        } else {
+            XDeleteProperty(display, targets[i], ATOM(_XROOTPMAP_ID));
+            XDeleteProperty(display, targets[i], ATOM(ESETROOT_PMAP_ID));
+        }
+    }
+}
+
+/* Copy what changed since the last update into the root pixmap. The pixmap
+ * stays the same, setting the property again is what tells clients to
+ * repaint. */
+static void on_rootpmap_timer(void *data) {
+    int i;
+
+    rootpmap.pending = false;
+    rootpmap.last = now_ms();
+    XFixesSetPictureClipRegion(display, rootpmap.picture, 0, 0, rootpmap.dirty);
+    for (i = 0; i < nwindows; i++) {
+        struct window *w = windows[i];
+
+        if (!w->rootpmap_picture)
+            continue;
+        XRenderComposite(display, PictOpSrc, w->rootpmap_picture, None, rootpmap.picture, 0, 0, 0,
+            0, w->x, w->y, w->width, w->height);
+    }
+    XFixesSetRegion(display, rootpmap.dirty, NULL, 0);
+    rootpmap_publish(rootpmap.pixmap);
+}
+
+/* Add the parts of w in rootpmap.parts to the next update, which is at
+ * most rate times a second however often the child draws. */
+static void rootpmap_damaged(struct window *w) {
+    uint64_t now = now_ms(), next = rootpmap.last + 1000 / rootpmap.rate;
+
+    XFixesTranslateRegion(display, rootpmap.parts, w->x, w->y);
+    XFixesUnionRegion(display, rootpmap.dirty, rootpmap.dirty, rootpmap.parts);
+    if (rootpmap.pending)
+        return;
+    rootpmap.pending = true;
+    set_timer(on_rootpmap_timer, NULL, next > now ? next - now : 0);
+}
+
+/* Redirect w, so it can be read while other windows cover it, and add all of
+ * it to the next update. Also called for outputs added later. */
+static void rootpmap_add_window(struct window *w) {
+    XRenderPictureAttributes pa;
+    XRectangle r;
+
+    pa.subwindow_mode = IncludeInferiors;
+    XCompositeRedirectWindow(display, w->window, CompositeRedirectAutomatic);
+    w->rootpmap_picture = XRenderCreatePicture(display, w->window,
+        XRenderFindVisualFormat(display, w->visual), CPSubwindowMode, &pa);
+    r.x = 0;
+    r.y = 0;
+    r.width = w->width;
+    r.height = w->height;
+    XFixesSetRegion(display, rootpmap.parts, &r, 1);
+    rootpmap_damaged(w);
+}
+
+static void rootpmap_start() {
+    Atom type;
+    int format, i;
+    unsigned long n, after;
+    unsigned char *data = NULL;
+
+    rootpmap.pixmap = XCreatePixmap(display, window.root, display_width, display_height,
+        DefaultDepth(display, screen));
+    rootpmap.picture = XRenderCreatePicture(display, rootpmap.pixmap,
+        XRenderFindVisualFormat(display, DefaultVisual(display, screen)), 0, NULL);
+    rootpmap.dirty = XFixesCreateRegion(display, NULL, 0);
+    rootpmap.parts = XFixesCreateRegion(display, NULL, 0);
+
+    /* start from the root pixmap there is, put back at exit */
+    round_trips++;
+    if (XGetWindowProperty(display, window.root, ATOM(_XROOTPMAP_ID), 0, 1, False, XA_PIXMAP,
+            &type, &format, &n, &after, &data)
+            == Success
+        && type == XA_PIXMAP && n == 1) {
+        rootpmap.old = *(Pixmap *) data;
+        XCopyArea(display, rootpmap.old, rootpmap.pixmap, DefaultGC(display, screen), 0, 0,
+            display_width, display_height, 0, 0);
+    } else {
+        XFillRectangle(display, rootpmap.pixmap, DefaultGC(display, screen), 0, 0,
+            display_width, display_height);
+    }
+    if (data)
+        XFree(data);
+
+    for (i = 0; i < nwindows; i++)
+        rootpmap_add_window(windows[i]);
+}
+
+/* The screen changed size: a new root pixmap of that size, with what the
+ * old one showed, published before the old one is freed. */
+static void rootpmap_resize() {
+    Pixmap old = rootpmap.pixmap;
+    XRectangle r;
+    int i;
+
+    rootpmap.pixmap = XCreatePixmap(display, window.root, display_width, display_height,
+        DefaultDepth(display, screen));
+    XFillRectangle(display, rootpmap.pixmap, DefaultGC(display, screen), 0, 0, display_width,
+        display_height);
+    XCopyArea(display, old, rootpmap.pixmap, DefaultGC(display, screen), 0, 0, display_width,
+        display_height, 0, 0);
+    XRenderFreePicture(display, rootpmap.picture);
+    rootpmap.picture = XRenderCreatePicture(display, rootpmap.pixmap,
+        XRenderFindVisualFormat(display, DefaultVisual(display, screen)), 0, NULL);
+    rootpmap_publish(rootpmap.pixmap);
+    XFreePixmap(display, old);
+
+    for (i = 0; i < nwindows; i++) {
+        r.x = 0;
+        r.y = 0;
+        r.width = windows[i]->width;
+        r.height = windows[i]->height;
+        XFixesSetRegion(display, rootpmap.parts, &r, 1);
+        rootpmap_damaged(windows[i]);
+    }
+}
+
+/* Start watching the child window once it is known. */
+static void watch_damage(struct window *w) {
+    if ((!freeze_ms && !max_fps && !snapshot_dir && !metrics_path && !rootpmap.rate)
+        || !have_damage || w->damage)
+        return;
+
+    w->damage = XDamageCreate(display, w->child, XDamageReportNonEmpty);
+    if (freeze_ms)
+        set_timer(on_freeze_timer, w, freeze_ms);
+    if (max_fps) {
+        w->duty = 1;
+        on_fps_duty(w);
+        set_timer(on_fps_window, w, FPS_WINDOW);
+    }
+}
+#endif
+
+static bool read_file(const char *path, char *buf, size_t len) {
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n < 0)
+        return false;
+    while (n > 0 && buf[n - 1] == '\n')
+        n--;
+    buf[n] = '\0';
+    return true;
+}
+
+static bool write_file(const char *path, const char *value) {
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        return false;
+    n = write(fd, value, strlen(value));
+    close(fd);
+    return n == (ssize_t) strlen(value);
+}
+
+/* Scheduling of the child, applied between fork and exec. Failures are
+ * reported but the child still runs. */
+static void set_child_scheduling() {
+    if (child_nice && setpriority(PRIO_PROCESS, 0, child_nice) < 0)
+        perror(NAME ": setpriority");
+    if (child_sched_idle) {
+        struct sched_param sp = { 0 };
+
+        if (sched_setscheduler(0, SCHED_IDLE, &sp) < 0)
+            perror(NAME ": sched_setscheduler");
+    }
+    if (child_io_idle
+        && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+            < 0)
+        perror(NAME ": ioprio_set");
+    if (CPU_COUNT(&child_cpus) && sched_setaffinity(0, sizeof(child_cpus), &child_cpus) < 0)
+        perror(NAME ": sched_setaffinity");
+    if (cgroup_path) {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup_path);
+        if (!write_file(path, "0"))
+            perror(path);
+    }
+}
+
+/* cpus is a list like 0-3,8 */
+static void parse_cpus(const char *cpus) {
+    const char *p = cpus;
+
+    CPU_ZERO(&child_cpus);
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+
+        if (end == p)
+            die("-cpus needs a list of CPUs (ex: -cpus 0-3,8).");
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (; first <= last && first < CPU_SETSIZE; first++)
+            CPU_SET(first, &child_cpus);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            die("-cpus needs a list of CPUs (ex: -cpus 0-3,8).");
+        p = end;
+    }
+}
+
+/* Limits of the child's cgroup, which can be changed while it runs. */
+static bool set_cgroup_limit(const char *file, const char *value) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", cgroup_path, file);
+    if (write_file(path, value))
+        return true;
+    fprintf(stderr, NAME ": can't set %s to %s: %s\n", path, value, strerror(errno));
+    return false;
+}
+
+/* cpu is a percentage of one CPU */
+static bool set_cgroup_cpu_max(double cpu) {
+    char value[32];
+
+    if (cpu <= 0)
+        return set_cgroup_limit("cpu.max", "max");
+    snprintf(value, sizeof(value), "%ld %d", (long) (cpu * CGROUP_PERIOD / 100), CGROUP_PERIOD);
+    return set_cgroup_limit("cpu.max", value);
+}
+
+/* Report when the child runs into its limits: memory.events is polled for
+ * changes, cpu.stat has no notification and is read every CGROUP_INTERVAL. */
+static unsigned long parse_counter(const char *buf, const char *key) {
+    const char *p;
+    size_t len = strlen(key);
+
+    for (p = buf; p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+        if (strncmp(p, key, len) == 0 && p[len] == ' ')
+            return strtoul(p + len + 1, NULL, 10);
+    return 0;
+}
+
+static unsigned long cgroup_counter(const char *file, const char *key) {
+    char path[PATH_MAX], buf[1024];
+
+    snprintf(path, sizeof(path), "%s/%s", cgroup_path, file);
+    if (!read_file(path, buf, sizeof(buf)))
+        return 0;
+    return parse_counter(buf, key);
+}
+
+static void report_counter(unsigned long n, unsigned long *last, const char *what) {
+    if (n > *last)
+        fprintf(stderr, NAME ": child %s %lu times\n", what, n - *last);
+    *last = n;
+}
+
+/* kernfs keeps fd readable for poll() until it is read again from the
+ * start, so it is read here rather than opened anew. */
+static void on_memory_events(int fd, short revents, void *data) {
+    char buf[1024];
+    ssize_t n;
+
+    if (lseek(fd, 0, SEEK_SET) < 0 || (n = read(fd, buf, sizeof(buf) - 1)) < 0)
+        return;
+    buf[n] = '\0';
+    report_counter(parse_counter(buf, "high"), &cgroup_events[0], "went over memory.high");
+    report_counter(parse_counter(buf, "max"), &cgroup_events[1], "hit memory.max");
+    report_counter(parse_counter(buf, "oom_kill"), &cgroup_events[2], "was OOM killed");
+}
+
+static void on_cgroup_timer(void *data) {
+    report_counter(
+        cgroup_counter("cpu.stat", "nr_throttled"), &cgroup_events[3], "was throttled by cpu.max");
+    set_timer(on_cgroup_timer, NULL, CGROUP_INTERVAL);
+}
+
+/* Put the children into a leaf of their own under dir, by default next to
+ * our own cgroup, which is where a delegated subtree allows it. */
+static void cgroup_start(char *dir, double cpu_max, const char *mem_max) {
+    char path[PATH_MAX];
+    int fd;
+
+    if (!dir) {
+        char buf[PATH_MAX], *line, *p;
+
+        /* the cgroup v2 line, the last one on hybrid hierarchies */
+        if (!read_file("/proc/self/cgroup", buf, sizeof(buf)))
+            die("Couldn't read /proc/self/cgroup:");
+        if (strncmp(buf, "0::/", 4) == 0)
+            line = buf;
+        else if ((line = strstr(buf, "\n0::/")))
+            line++;
+        else
+            die("Couldn't find our cgroup, is cgroup v2 mounted?");
+        if ((p = strchr(line, '\n')))
+            *p = '\0';
+        *strrchr(line, '/') = '\0';
+        if (asprintf(&dir, CGROUP_ROOT "%s", line + 3) < 0)
+            die("Out of memory.");
+    }
+
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir);
+    if (!write_file(path, "+cpu +memory") && debug)
+        fprintf(stderr, NAME ": can't enable the cpu and memory controllers in %s\n", dir);
+
+    if (asprintf(&cgroup_path, "%s/" NAME "-%d", dir, getpid()) < 0)
+        die("Out of memory.");
+    if (mkdir(cgroup_path, 0755) < 0 && errno != EEXIST)
+        die("Couldn't create %s:", cgroup_path);
+    if (debug)
+        fprintf(stderr, NAME ": children run in %s\n", cgroup_path);
+
+    if (cpu_max)
+        set_cgroup_cpu_max(cpu_max);
+    if (mem_max)
+        set_cgroup_limit("memory.max", mem_max);
+
+    snprintf(path, sizeof(path), "%s/memory.events", cgroup_path);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        on_memory_events(fd, 0, NULL);
+        watch_fd(fd, POLLPRI, on_memory_events, NULL);
+    }
+    on_cgroup_timer(NULL);
+}
+
+static void signal_children(int sig) {
+    int i;
+
+    for (i = 0; i < nwindows; i++) {
+        struct window *w = windows[i];
+
+        if (w->pid <= 0)
+            continue;
+        kill(-w->pid, sig);
+        /* a stopped child would not act on the signal until continued */
+        if (w->paused)
+            kill(-w->pid, SIGCONT);
+    }
+#ifdef HAVE_XDAMAGE
+    /* -playlist: the one warming up, or the replaced one not reaped yet */
+    if (warm.pid > 0) {
+        kill(-warm.pid, sig);
+        kill(-warm.pid, SIGCONT);
+    }
+#endif
+}
+
+static void on_restart_timer(void *data);
+#ifdef HAVE_XDAMAGE
+static void warm_exited();
+#endif
+
+/* Schedule a restart of the child of w, unless it has been crashing in a
+ * row for too long. */
+static bool restart_child(struct window *w) {
+    uint64_t ran = now_ms() - w->started;
+
+    if (ran >= RESTART_STABLE || !w->backoff) {
+        w->crashes = 0;
+        w->backoff = RESTART_MIN;
+    }
+    if (++w->crashes > restart_limit) {
+        fprintf(stderr, NAME ": child crashed %d times in a row, giving up\n", w->crashes - 1);
+        return false;
+    }
+
+    w->restarts++;
+    w->restarting = true;
+    fprintf(stderr, NAME ": child ran for %.1f s, restart %u in %.1f s\n", ran / 1000.0,
+        w->restarts, w->backoff / 1000.0);
+    set_timer(on_restart_timer, w, w->backoff);
+    w->backoff = w->backoff * 2 < RESTART_MAX ? w->backoff * 2 : RESTART_MAX;
+
+    /* its window is gone, the wrapper keeps showing the last frame */
+    w->child = 0;
+#ifdef HAVE_XDAMAGE
+    w->damage = 0;
+#endif
+    return true;
+}
+
+static void reap_child(struct window *w) {
+    int status, i;
+
+    if (w->pid <= 0 || waitpid(w->pid, &status, WNOHANG) != w->pid)
+        return;
+
+    if (WIFEXITED(status) && !w->evicted)
+        fprintf(stderr, "%s died, exit status %d\n", child_argv[0], WEXITSTATUS(status));
+
+    w->pid = 0;
+    if (w->pidfd >= 0) {
+        unwatch_fd(w->pidfd);
+        close(w->pidfd);
+        w->pidfd = -1;
+    }
+
+#ifdef HAVE_XDAMAGE
+    if (w == &warm) {
+        warm_exited();
+        return;
+    }
+#endif
+
+    /* replace_child(), started right away like a restart */
+    if (w->swapping) {
+        w->swapping = false;
+        w->restarting = true;
+        set_timer(on_restart_timer, w, 0);
+        return;
+    }
+
+    if (restart_limit && !stopping && !w->evicted
+        && (!WIFEXITED(status) || WEXITSTATUS(status) != 0) && restart_child(w))
+        return;
+
+    for (i = 0; i < nwindows; i++)
+        if (windows[i]->pid > 0 || windows[i]->evicted || windows[i]->restarting)
+            return;
+    running = false;
+}
+
+static void on_child_exit(int fd, short revents, void *data) {
+    reap_child(data);
+}
+
+/* Start the command for w with the placeholder replaced by the window id,
+ * in its own process group so the whole tree can be stopped at once. */
+static void spawn_child(struct window *w) {
+    char **argv, wid[32];
+    int i;
+
+    snprintf(wid, sizeof(wid), "0x%lx", w->inner);
+    argv = malloc((child_argc + 1) * sizeof(char *));
+    for (i = 0; i < child_argc; i++) {
+        char *m = strstr(child_argv[i], wid_placeholder);
+
+        argv[i] = child_argv[i];
+        if (m) {
+            size_t len = strlen(child_argv[i]) - strlen(wid_placeholder) + strlen(wid) + 1;
+
+            argv[i] = malloc(len);
+            snprintf(argv[i], len, "%.*s%s%s", (int) (m - child_argv[i]), child_argv[i], wid,
+                m + strlen(wid_placeholder));
+        }
+    }
+    argv[child_argc] = NULL;
+
+    w->pid = fork();
+    w->started = now_ms();
+
+    switch (w->pid) {
+    case -1: die("fork failed:");
+    case 0:
+        setpgid(0, 0);
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        set_child_scheduling();
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        exit(2);
+    }
+    setpgid(w->pid, w->pid);
+
+    for (i = 0; i < child_argc; i++)
+        if (argv[i] != child_argv[i])
+            free(argv[i]);
+    free(argv);
+
+    w->pidfd = syscall(SYS_pidfd_open, w->pid, 0);
+    if (w->pidfd >= 0)
+        watch_fd(w->pidfd, POLLIN, on_child_exit, w);
+    else if (debug)
+        fprintf(stderr, NAME ": pidfd_open failed, falling back to SIGCHLD\n");
+
+    /* stop reasons apply to the new child as well */
+    if (w->paused)
+        kill(-w->pid, SIGSTOP);
+}
+
+/* Terminate the child of w, to be started again at once with child_argv
+ * when it has been reaped. */
+static void replace_child(struct window *w) {
+    if (w->pid <= 0)
+        return;
+    w->swapping = true;
+    kill(-w->pid, SIGTERM);
+    kill(-w->pid, SIGCONT);
+    /* its window goes away with it, and the damage on it */
+    w->child = 0;
+#ifdef HAVE_XDAMAGE
+    w->damage = 0;
+#endif
+}
+
+static void on_signal(int fd, short revents, void *data) {
+    struct signalfd_siginfo si;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD) {
+            int i;
+
+            /* only needed when pidfds are not available */
+            for (i = 0; i < nwindows; i++)
+                reap_child(windows[i]);
+#ifdef HAVE_XDAMAGE
+            reap_child(&warm);
+#endif
+            continue;
+        }
+        if (si.ssi_signo != SIGUSR1 && si.ssi_signo != SIGUSR2 && !stopping) {
+            int i;
+
+            stopping = true;
+            /* the last frame, while the child is still there */
+            for (i = 0; i < nwindows && snapshot_dir; i++)
+                snapshot_save(windows[i]);
+        }
+        /* nothing to forward to with -image or -stream */
+        if (child_argc == 0 && si.ssi_signo != SIGUSR1 && si.ssi_signo != SIGUSR2) {
+            running = false;
+            continue;
+        }
+        if (debug)
+            fprintf(stderr, NAME ": forwarding signal %d to children\n", si.ssi_signo);
+        signal_children(si.ssi_signo);
+    }
+}
+
+/* Backing off the child in levels, the highest asked for by -psi or
+ * -power:
+ *   1 the child only runs a quarter of the time,
+ *   2 the child is frozen on its last frame,
+ *   3 the child is terminated, and started again below level 3. */
+static void on_backoff_duty(void *data) {
+    int i;
+
+    backoff_stopped = !backoff_stopped;
+    for (i = 0; i < nwindows; i++)
+        set_paused(windows[i], PAUSE_BACKOFF, backoff_stopped);
+    set_timer(on_backoff_duty, NULL, backoff_stopped ? IDLE_STOP_MS : IDLE_RUN_MS);
+}
+
+static void update_backoff() {
+    int old = backoff_level, level = psi_level > power_level ? psi_level : power_level, i;
+
+    if (level == old)
+        return;
+    backoff_level = level;
+    if (debug)
+        fprintf(stderr, NAME ": backing off the child at level %d\n", level);
+
+    cancel_timer(on_backoff_duty, NULL);
+    backoff_stopped = level >= 2;
+    for (i = 0; i < nwindows; i++) {
+        struct window *w = windows[i];
+
+        set_paused(w, PAUSE_BACKOFF, backoff_stopped);
+        if (level >= 2)
+            freeze(w);
+        else if (old >= 2)
+            thaw(w);
+
+        if (level == 3 && w->pid > 0) {
+            w->evicted = true;
+            kill(-w->pid, SIGTERM);
+            kill(-w->pid, SIGCONT);
+            /* its window goes away with it, and the damage on it */
+            w->child = 0;
+#ifdef HAVE_XDAMAGE
+            w->damage = 0;
+#endif
+        } else if (level < 3 && w->evicted && w->pid <= 0) {
+            w->evicted = false;
+            spawn_child(w);
+        }
+    }
+    if (level == 1)
+        on_backoff_duty(NULL);
+}
+
+/* -psi: pressure stall triggers for cpu, memory and io at the three levels
+ * of stalled time. A trigger firing raises the level to its own at least,
+ * PSI_HOLD without any trigger firing lowers it by one. */
+static void psi_set_level(int level) {
+    if (debug)
+        fprintf(stderr, NAME ": pressure at level %d\n", level);
+    psi_level = level;
+    update_backoff();
+}
+
+static void on_psi_calm(void *data) {
+    psi_set_level(psi_level - 1);
+    if (psi_level > 0)
+        set_timer(on_psi_calm, NULL, PSI_HOLD);
+}
+
+static void on_psi_trigger(int fd, short revents, void *data) {
+    int level = (intptr_t) data;
+
+    if (revents & POLLERR) {
+        unwatch_fd(fd);
+        close(fd);
+        return;
+    }
+    if (level > psi_level)
+        psi_set_level(level);
+    set_timer(on_psi_calm, NULL, PSI_HOLD);
+}
+
+/* levels is three percentages of PSI_WINDOW that tasks were stalled, like
+ * 5,15,30 */
+static void psi_start(const char *levels) {
+    const char *resources[] = { "cpu", "memory", "io" };
+    int percent[3], i, j;
+
+    if (sscanf(levels, "%d,%d,%d", &percent[0], &percent[1], &percent[2]) != 3
+        || percent[0] <= 0 || percent[0] > percent[1] || percent[1] > percent[2]
+        || percent[2] > 100)
+        die("-psi needs three rising percentages (ex: -psi 5,15,30).");
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            char path[32], trigger[64];
+            int fd;
+
+            snprintf(path, sizeof(path), "/proc/pressure/%s", resources[i]);
+            snprintf(trigger, sizeof(trigger), "some %d %d",
+                percent[j] * (PSI_WINDOW / 100), PSI_WINDOW);
+            fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0 || write(fd, trigger, strlen(trigger) + 1) < 0)
+                die("Couldn't set a trigger on %s:", path);
+            watch_fd(fd, POLLPRI, on_psi_trigger, (void *) (intptr_t) (j + 1));
+        }
+    }
+}
+
+/* -power: the backoff level follows the power supply, read from sysfs when
+ * the kernel reports a power_supply uevent. */
+static bool read_sysfs(const char *dir, const char *name, char *buf, size_t len) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s/%s", power_root, dir, name);
+    return read_file(path, buf, len);
+}
+
+static void power_changed() {
+    static const char *states[] = { "AC", "battery", "low battery" };
+    bool discharging = false;
+    int capacity = 100, state;
+    struct dirent *de;
+    char buf[32];
+    DIR *dir;
+
+    if (!(dir = opendir(power_root)))
+        return;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.' || !read_sysfs(de->d_name, "type", buf, sizeof(buf))
+            || strcmp(buf, "Battery") != 0)
+            continue;
+        if (read_sysfs(de->d_name, "status", buf, sizeof(buf))
+            && strcmp(buf, "Discharging") == 0)
+            discharging = true;
+        if (read_sysfs(de->d_name, "capacity", buf, sizeof(buf)) && atoi(buf) < capacity)
+            capacity = atoi(buf);
+    }
+    closedir(dir);
+
+    state = !discharging ? 0 : capacity > power_low ? 1 : 2;
+    if (debug && power_levels[state] != power_level)
+        fprintf(stderr, NAME ": on %s (%d%%)\n", states[state], capacity);
+    power_level = power_levels[state];
+    update_backoff();
+}
+
+static void on_uevent(int fd, short revents, void *data) {
+    char buf[8192];
+    bool changed = false;
+    ssize_t n;
+
+    /* messages are NUL separated KEY=VALUE strings */
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        char *p;
+
+        buf[n] = '\0';
+        for (p = buf; p < buf + n; p += strlen(p) + 1)
+            if (strcmp(p, "SUBSYSTEM=power_supply") == 0)
+                changed = true;
+    }
+    if (changed)
+        power_changed();
+}
+
+/* policy is the level name on AC, on battery and on low battery, then
+ * optionally what low is, like full,slow,off,20 */
+static void power_start(const char *policy) {
+    static const char *names[] = { "full", "slow", "frozen", "off" };
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    char *copy = strdup(policy), *tok, *save;
+    int i, n = 0, fd;
+
+    power_low = POWER_LOW;
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save), n++) {
+        if (n == 3) {
+            power_low = atoi(tok);
+            continue;
+        }
+        for (i = 0; i < 4 && strcmp(tok, names[i]) != 0; i++)
+            ;
+        if (n > 3 || i == 4)
+            die("-power needs AC,BATTERY,LOW[,PERCENT] of full, slow, frozen or off "
+                "(ex: -power full,slow,off,20).");
+        power_levels[n] = i;
+    }
+    if (n < 3)
+        die("-power needs AC,BATTERY,LOW[,PERCENT] of full, slow, frozen or off "
+            "(ex: -power full,slow,off,20).");
+    free(copy);
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        fprintf(stderr, NAME ": can't listen for uevents, power changes are not followed\n");
+    else
+        watch_fd(fd, POLLIN, on_uevent, NULL);
+
+    power_changed();
+}
+
+/* -metrics: what each wallpaper costs, in the Prometheus text format. Every
+ * METRICS_INTERVAL the processes of each child's process group, which is what
+ * sh -c and launchers fork into, are summed from files kept open, and the X
+ * server is asked once per window for the pixmap bytes of the child. The
+ * group is looked up again every METRICS_RESCAN collections, or when the
+ * child changed, from the cgroup with -cgroup and from /proc otherwise. */
+static void metrics_close(struct window *w) {
+    int i;
+
+    for (i = 0; i < w->nprocs; i++) {
+        close(w->procs[i].stat_fd);
+        if (w->procs[i].smaps_fd >= 0)
+            close(w->procs[i].smaps_fd);
+    }
+    w->nprocs = 0;
+}
+
+static bool metrics_read(int fd, char *buf, size_t len) {
+    ssize_t n;
+
+    if (fd < 0 || (n = pread(fd, buf, len - 1, 0)) <= 0)
+        return false;
+    buf[n] = '\0';
+    return true;
+}
+
+/* "pid (comm) state ppid pgrp ...", utime is the 12th field after the name,
+ * cutime and cstime count the children already reaped */
+static bool metrics_parse_stat(const char *buf, pid_t *pgrp, double *cpu) {
+    static long ticks = 0;
+    unsigned long utime, stime;
+    long cutime, cstime;
+    const char *p = strrchr(buf, ')');
+
+    if (!ticks)
+        ticks = sysconf(_SC_CLK_TCK);
+    if (!p
+        || sscanf(p + 1, " %*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld", pgrp,
+               &utime, &stime, &cutime, &cstime)
+            != 5)
+        return false;
+    *cpu = (double) (utime + stime + cutime + cstime) / ticks;
+    return true;
+}
+
+/* Keep the files of process pid open if it is in the group of a child. */
+static void metrics_add_proc(const char *pid) {
+    char path[64], buf[1024];
+    struct window *w = NULL;
+    struct metrics_proc *proc;
+    pid_t pgrp;
+    double cpu;
+    int fd, i;
+
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (metrics_read(fd, buf, sizeof(buf)) && metrics_parse_stat(buf, &pgrp, &cpu))
+        for (i = 0; i < nwindows && !w; i++)
+            if (windows[i]->pid > 0 && windows[i]->pid == pgrp)
+                w = windows[i];
+    if (!w) {
+        close(fd);
+        return;
+    }
+
+    if (w->nprocs == w->procs_cap) {
+        w->procs_cap = w->procs_cap ? w->procs_cap * 2 : 8;
+        w->procs = realloc(w->procs, w->procs_cap * sizeof(*w->procs));
+    }
+    proc = &w->procs[w->nprocs++];
+    proc->stat_fd = fd;
+    snprintf(path, sizeof(path), "/proc/%s/smaps_rollup", pid);
+    proc->smaps_fd = open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void metrics_scan() {
+    char pid[32];
+    int i;
+
+    for (i = 0; i < nwindows; i++) {
+        metrics_close(windows[i]);
+        windows[i]->metrics_pid = windows[i]->pid;
+    }
+
+    if (cgroup_path) {
+        char path[PATH_MAX];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup_path);
+        if ((f = fopen(path, "r"))) {
+            while (fgets(pid, sizeof(pid), f)) {
+                pid[strcspn(pid, "\n")] = '\0';
+                metrics_add_proc(pid);
+            }
+            fclose(f);
+            return;
+        }
+    }
+
+    {
+        struct dirent *de;
+        DIR *dir = opendir("/proc");
+
+        if (!dir)
+            return;
+        while ((de = readdir(dir)) != NULL)
+            if (de->d_name[0] >= '0' && de->d_name[0] <= '9')
+                metrics_add_proc(de->d_name);
+        closedir(dir);
+    }
+}
+
+static void metrics_collect_procs() {
+    static unsigned int collections = 0;
+    char buf[1024], *p;
+    bool rescan = collections++ % METRICS_RESCAN == 0;
+    int i, j;
+
+    for (i = 0; i < nwindows; i++)
+        rescan = rescan || windows[i]->metrics_pid != windows[i]->pid;
+    if (rescan)
+        metrics_scan();
+
+    for (i = 0; i < nwindows; i++) {
+        struct window *w = windows[i];
+
+        w->cpu = 0;
+        w->rss = 0;
+        for (j = 0; j < w->nprocs; j++) {
+            struct metrics_proc *proc = &w->procs[j];
+            unsigned long pss;
+            pid_t pgrp;
+            double cpu;
+
+            /* exited, its files read nothing even if the pid is reused */
+            if (!metrics_read(proc->stat_fd, buf, sizeof(buf))
+                || !metrics_parse_stat(buf, &pgrp, &cpu) || pgrp != w->pid) {
+                close(proc->stat_fd);
+                if (proc->smaps_fd >= 0)
+                    close(proc->smaps_fd);
+                w->procs[j--] = w->procs[--w->nprocs];
+                continue;
+            }
+            w->cpu += cpu;
+            /* proportional, so what the processes share is counted once */
+            if (metrics_read(proc->smaps_fd, buf, sizeof(buf)) && (p = strstr(buf, "\nPss:"))
+                && sscanf(p + 5, "%lu", &pss) == 1)
+                w->rss += pss * 1024;
+        }
+    }
+}
+
+static void metrics_collect() {
+    uint64_t now = now_ms();
+    int i;
+
+    metrics_collect_procs();
+    for (i = 0; i < nwindows; i++) {
+        struct window *w = windows[i];
+
+#ifdef HAVE_XDAMAGE
+        if (now > w->metrics_time && w->metrics_time)
+            w->fps = (w->frames_total - w->metrics_frames) * 1000.0 / (now - w->metrics_time);
+        w->metrics_frames = w->frames_total;
+#endif
+        w->metrics_time = now;
+
+#ifdef HAVE_XRES
+        if (have_xres) {
+            round_trips++;
+            if (!w->child || !XResQueryClientPixmapBytes(display, w->child, &w->child_pixmaps))
+                w->child_pixmaps = 0;
+        }
+#endif
+    }
+#ifdef HAVE_XRES
+    if (have_xres) {
+        round_trips++;
+        if (!XResQueryClientPixmapBytes(display, window.window, &own_pixmaps))
+            own_pixmaps = 0;
+    }
+#endif
+}
+
+#define METRIC(name, type, help)                                                                   \
+    fprintf(f, "# HELP " NAME "_" name " " help "\n# TYPE " NAME "_" name " " type "\n")
+
+#define PER_WINDOW(name, type, help, fmt, value)                                                   \
+    METRIC(name, type, help);                                                                      \
+    for (i = 0; i < nwindows; i++)                                                                 \
+    fprintf(f, NAME "_" name "{window=\"%d\"} " fmt "\n", i, windows[i]->value)
+
+static void metrics_write(FILE *f) {
+    char path[PATH_MAX], buf[32];
+    int i;
+
+    METRIC("uptime_seconds", "gauge", "Time since xwinwrap started.");
+    fprintf(f, NAME "_uptime_seconds %.1f\n", (now_us() - trace_start) / 1e6);
+    PER_WINDOW("child_cpu_seconds_total", "counter", "CPU time of the child's processes.", "%.2f",
+        cpu);
+    PER_WINDOW("child_rss_bytes", "gauge", "Proportional resident memory of the child's processes.",
+        "%lu", rss);
+    PER_WINDOW("restarts_total", "counter",
+        "Times the child was started again after a crash or over -pixmap-max.", "%u", restarts);
+    PER_WINDOW("paused", "gauge", "Whether the child is stopped.", "%d", paused != 0);
+#ifdef HAVE_XDAMAGE
+    if (have_damage) {
+        PER_WINDOW("frames_total", "counter", "Damage events on the child's window.", "%lu",
+            frames_total);
+        PER_WINDOW("fps", "gauge", "Damage events per second over the last interval.", "%.1f", fps);
+    }
+#endif
+#ifdef HAVE_XRES
+    if (have_xres) {
+        PER_WINDOW("child_pixmap_bytes", "gauge", "Pixmap memory of the child's X client.", "%lu",
+            child_pixmaps);
+        METRIC("pixmap_bytes", "gauge", "Pixmap memory of xwinwrap's own X client.");
+        fprintf(f, NAME "_pixmap_bytes %lu\n", own_pixmaps);
+    }
+#endif
+
+    if (cgroup_path) {
+        METRIC("cgroup_cpu_seconds_total", "counter", "CPU time of the child's cgroup.");
+        fprintf(f, NAME "_cgroup_cpu_seconds_total %.2f\n",
+            cgroup_counter("cpu.stat", "usage_usec") / 1e6);
+        snprintf(path, sizeof(path), "%s/memory.current", cgroup_path);
+        if (read_file(path, buf, sizeof(buf))) {
+            METRIC("cgroup_memory_bytes", "gauge", "Memory charged to the child's cgroup.");
+            fprintf(f, NAME "_cgroup_memory_bytes %s\n", buf);
+        }
+    }
+}
+
+#undef PER_WINDOW
+#undef METRIC
+
+static void on_metrics_timer(void *data) {
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    metrics_collect();
+    /* replaced at once, a scraper never reads half a file */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+    if ((f = fopen(tmp, "w"))) {
+        metrics_write(f);
+        if (fclose(f) != 0 || rename(tmp, metrics_path) != 0)
+            unlink(tmp);
+    }
+    set_timer(on_metrics_timer, NULL, METRICS_INTERVAL);
+}
+
+#ifdef HAVE_XRES
+/* -pixmap-max: pixmaps a child leaks are charged to the X server, where no
+ * memory limit of the child sees them. Their size is checked every
+ * PIXMAP_INTERVAL through X-Resource. */
+static void on_pixmap_timer(void *data) {
+    int i;
+
+    for (i = 0; i < nwindows; i++) {
+        struct window *w = windows[i];
+        unsigned long bytes;
+
+        round_trips++;
+        if (!w->child || !XResQueryClientPixmapBytes(display, w->child, &bytes))
+            continue;
+        if (w->pixmaps_before) {
+            fprintf(stderr, NAME ": child pixmaps at %lu KiB after the restart, %lu KiB before\n",
+                bytes >> 10, w->pixmaps_before >> 10);
+            w->pixmaps_before = 0;
+        }
+        if (bytes <= pixmap_max) {
+            w->pixmaps_warned = false;
+            continue;
+        }
+        if (!pixmap_restart) {
+            if (!w->pixmaps_warned)
+                fprintf(stderr, NAME ": child pixmaps at %lu KiB, over -pixmap-max\n",
+                    bytes >> 10);
+            w->pixmaps_warned = true;
+            continue;
+        }
+        fprintf(stderr, NAME ": child pixmaps at %lu KiB, over -pixmap-max, restarting it\n",
+            bytes >> 10);
+        w->pixmaps_before = bytes;
+        w->restarts++;
+        replace_child(w);
+    }
+    set_timer(on_pixmap_timer, NULL, PIXMAP_INTERVAL);
+}
+#endif
+
+/* -control: a Unix socket taking one command per line. Every command is
+ * answered with a line starting with "ok" or "error", stats precedes it
+ * with a line per window. */
+static void control_reply(struct control_client *c, const char *fmt, ...) {
+    char line[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (len > (int) sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+    /* replies are small, a client not reading them loses them */
+    send(c->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* Terminate the children and start cmd in their place, keeping the
+ * wrappers and their last frames. */
+static bool control_swap(const char *cmd) {
+    int i;
+
+    if (child_argc == 0)
+        return false;
+#ifdef HAVE_XDAMAGE
+    if (nplaylist)
+        return false;
+#endif
+    free(control_argv[2]);
+    control_argv[2] = strdup(cmd);
+    child_argv = control_argv;
+    child_argc = 3;
+
+    for (i = 0; i < nwindows; i++)
+        replace_child(windows[i]);
+    return true;
+}
+
+static void control_command(struct control_client *c, char *line) {
+    char *arg = line + strcspn(line, " ");
+    const char *error = NULL;
+    int i;
+
+    if (*arg)
+        *arg++ = '\0';
+    if (debug)
+        fprintf(stderr, NAME ": control: %s %s\n", line, arg);
+
+    if (strcmp(line, "set-opacity") == 0) {
+        char *end;
+        double value = strtod(arg, &end);
+
+        /* the range is checked before the conversion, which overflows */
+        if (*arg && !*end && value >= 0 && value <= 1) {
+            opacity = (unsigned int) (value * OPAQUE);
+            for (i = 0; i < nwindows; i++)
+                set_window_opacity(windows[i], opacity);
+        } else {
+            error = "set-opacity needs a value between 0 and 1";
+        }
+    } else if (strcmp(line, "set-geometry") == 0) {
+        int x = window.x, y = window.y;
+        unsigned int width = window.width, height = window.height;
+
+        if (fullscreen || per_output)
+            error = "set-geometry cannot be used with -fs or -per-output";
+        else if (!XParseGeometry(arg, &x, &y, &width, &height) || !width || !height)
+            error = "set-geometry needs {w}x{h}+{x}+{y}";
+        else
+            resize_window(&window, x, y, width, height);
+    } else if (strcmp(line, "pause") == 0) {
+        for (i = 0; i < nwindows; i++)
+            set_paused(windows[i], PAUSE_CONTROL, true);
+    } else if (strcmp(line, "resume") == 0) {
+        /* also a child -freeze stopped, but not one -psi or -power froze */
+        for (i = 0; i < nwindows; i++) {
+            set_paused(windows[i], PAUSE_CONTROL, false);
+            if (backoff_level < 2)
+                thaw(windows[i]);
+        }
+    } else if (strcmp(line, "swap-command") == 0) {
+        if (!*arg)
+            error = "swap-command needs a command";
+        else if (!control_swap(arg))
+            error = "swap-command cannot be used with -image, -stream or -playlist";
+    } else if (strcmp(line, "reshape") == 0) {
+        if (strcmp(arg, "rectangle") == 0)
+            shape = SHAPE_RECT;
+        else if (strcmp(arg, "circle") == 0)
+            shape = SHAPE_CIRCLE;
+        else if (strcmp(arg, "triangle") == 0)
+            shape = SHAPE_TRIG;
+        else if (access(arg, F_OK) != 0)
+            error = "reshape needs rectangle, circle, triangle or a mask file";
+        else if (mask_open(arg, &error))
+            shape = SHAPE_MASK;
+        for (i = 0; i < nwindows && !error; i++) {
+            if (shape == SHAPE_RECT)
+                XShapeCombineMask(display, windows[i]->window, ShapeBounding, 0, 0, None, ShapeSet);
+            else
+                apply_shape(windows[i]);
+        }
+    } else if (strcmp(line, "set-cpu-max") == 0) {
+        if (!cgroup_path)
+            error = "set-cpu-max needs -cgroup, -cpu-max or -mem-max";
+        else if (!*arg)
+            error = "set-cpu-max needs a percentage of one CPU, or max";
+        else if (!set_cgroup_cpu_max(atof(arg)))
+            error = "can't set cpu.max";
+    } else if (strcmp(line, "set-mem-max") == 0) {
+        if (!cgroup_path)
+            error = "set-mem-max needs -cgroup, -cpu-max or -mem-max";
+        else if (!*arg)
+            error = "set-mem-max needs a size, or max";
+        else if (!set_cgroup_limit("memory.max", arg))
+            error = "can't set memory.max";
+    } else if (strcmp(line, "metrics") == 0) {
+        char *text;
+        size_t len;
+        FILE *f;
+
+        if (!metrics_path) {
+            error = "metrics needs -metrics";
+        } else if ((f = open_memstream(&text, &len))) {
+            metrics_collect();
+            metrics_write(f);
+            fclose(f);
+            send(c->fd, text, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            free(text);
+        }
+    } else if (strcmp(line, "stats") == 0) {
+        for (i = 0; i < nwindows; i++) {
+            struct window *w = windows[i];
+
+            control_reply(c, "window %d 0x%lx %ux%u+%d+%d pid %d paused 0x%x restarts %u", i,
+                w->window, w->width, w->height, w->x, w->y, w->pid, w->paused, w->restarts);
+        }
+    } else {
+        error = "unknown command";
+    }
+
+    if (error)
+        control_reply(c, "error %s", error);
+    else
+        control_reply(c, "ok");
+}
+
+static void control_close(struct control_client *c) {
+    unwatch_fd(c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void on_control_read(int fd, short revents, void *data) {
+    struct control_client *c = data;
+    char *line, *end;
+    ssize_t n;
+
+    /* the client was closed earlier in this round of poll() */
+    if (c->fd != fd)
+        return;
+
+    n = read(fd, c->buf + c->len, sizeof(c->buf) - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        control_close(c);
+        return;
+    }
+    c->len += n;
+
+    line = c->buf;
+    while ((end = memchr(line, '\n', c->len - (line - c->buf)))) {
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        if (*line)
+            control_command(c, line);
+        line = end + 1;
+    }
+    c->len -= line - c->buf;
+    memmove(c->buf, line, c->len);
+    if (c->len == sizeof(c->buf)) {
+        control_reply(c, "error line too long");
+        control_close(c);
+    }
+}
+
+static void on_control_accept(int fd, short revents, void *data) {
+    int cfd, i;
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (i = 0; i < CONTROL_CLIENTS && control_clients[i].fd >= 0; i++)
+            ;
+        if (i == CONTROL_CLIENTS) {
+            close(cfd);
+            continue;
+        }
+        control_clients[i].fd = cfd;
+        control_clients[i].len = 0;
+        watch_fd(cfd, POLLIN, on_control_read, &control_clients[i]);
+    }
+}
+
+static void control_start(const char *path) {
+    struct sockaddr_un addr = { AF_UNIX };
+    int fd, i;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        die("-control path %s is too long.", path);
+    strcpy(addr.sun_path, path);
+
+    /* a socket left behind by an xwinwrap that is gone is replaced */
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        die("socket failed:");
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+        die("%s is in use by another xwinwrap.", path);
+    close(fd);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        die("socket failed:");
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, CONTROL_CLIENTS) < 0)
+        die("Couldn't listen on %s:", path);
+    control_path = path;
+
+    for (i = 0; i < CONTROL_CLIENTS; i++)
+        control_clients[i].fd = -1;
+    watch_fd(fd, POLLIN, on_control_accept, NULL);
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: %s [-g {w}x{h}+{x}+{y}] [-ni] [-argb] [-fdt] [-fs] [-s] [-st] [-sp] [-a] [-d] "
+        "[-b] [-nf] [-o OPACITY] [-sh SHAPE] [-ov] [-fa] [-fc CLASS] [-pc] [-pb] "
+        "[-idle SECONDS] [-per-output] [-mirror] [-scale FACTOR] [-freeze SECONDS] "
+        "[-max-fps N] [-psi LEVELS] [-power POLICY] [-nice N] [-sched-idle] [-io-idle] "
+        "[-cpus LIST] [-cgroup DIR] [-cpu-max PERCENT] [-mem-max BYTES] [-restart N] "
+        "[-playlist FILE [-rotate SECONDS]] [-snapshot] [-snapshot-dir DIR] [-control SOCKET] "
+        "[-metrics FILE] [-pixmap-max MB [-pixmap-restart]] [-rootpmap RATE] [-trace] "
+        "{-image FILE [-image-mem MB] | -stream FILE [-stream-size WxH] | -- COMMAND ARG1 ...}\n",
+        NAME);
+    fprintf(stderr, "Options:\n \
+            -g      - Specify Geometry (w=width, h=height, x=x-coord, y=y-coord. ex: -g 640x480+100+100)\n \
+            -ni     - Ignore Input\n \
+            -argb   - RGB\n \
+            -fdt    - force WID window a desktop type window\n \
+            -sub    - Set WID placeholder (default is %s)\n \
+            -fs     - Full Screen\n \
+            -un     - Undecorated\n \
+            -s      - Sticky\n \
+            -st     - Skip Taskbar\n \
+            -sp     - Skip Pager\n \
+            -a      - Above\n \
+            -b      - Below\n \
+            -nf     - No Focus\n \
+            -o      - Opacity value between 0 to 1 (ex: -o 0.20)\n \
+            -sh     - Shape of window (choose between rectangle, circle, triangle or a PNG or\n \
+                      XBM mask file. Default is rectangle)\n \
+            -ov     - Set override_redirect flag (For seamless desktop background integration in non-fullscreenmode)\n \
+            -d      - Daemonize\n \
+            -fa     - Force the child window to attach (no need to provide it with WID)\n \
+            -fc     - Attach the window with this WM_CLASS name or class under -fa\n \
+            -pc     - Pause the child while the window is fully covered by other windows\n \
+            -pb     - Pause the child while the screen saver is active or the monitors are off\n \
+            -idle   - Run the child at a quarter of the time after this many seconds without\n \
+                      input\n \
+            -per-output - One window and child per monitor, stopped while the monitor is off\n \
+            -mirror - With -per-output, run one child and copy its frames to the other monitors\n \
+            -scale  - Render the child at this fraction of the window size (ex: -scale 0.5)\n \
+            -freeze - Stop the child and keep its last frame after this many seconds without\n \
+                      changes\n \
+            -max-fps - Stop and continue the child so its window changes at most N times a\n \
+                      second\n \
+            -psi    - Slow down, freeze, then terminate the child as cpu, memory or io pressure\n \
+                      reaches these percentages of stalled time (ex: -psi 5,15,30)\n \
+            -power  - Run the child full, slow, frozen or off on AC, battery and low battery,\n \
+                      optionally with the low percentage (ex: -power full,slow,off,20)\n \
+            -power-root - Where to read power supplies from (default is %s)\n \
+            -nice   - Run the child at this nice level\n \
+            -sched-idle - Run the child with SCHED_IDLE\n \
+            -io-idle - Run the child in the idle I/O priority class\n \
+            -cpus   - Run the child only on these CPUs (ex: -cpus 4-7)\n \
+            -cgroup - Run the child in a cgroup of its own under this cgroup v2 directory\n \
+                      (default is next to the cgroup xwinwrap runs in)\n \
+            -cpu-max - Limit the child's cgroup to this percentage of one CPU (ex: -cpu-max 50)\n \
+            -mem-max - Limit the child's cgroup to this much memory (ex: -mem-max 512M)\n \
+            -restart - Start a crashed child again, up to N times in a row, keeping its last\n \
+                      frame\n \
+            -playlist - Run the commands in this file in turn instead of COMMAND, each started\n \
+                      offscreen and shown once it has drawn\n \
+            -rotate - Seconds each -playlist command runs (default %d)\n \
+            -snapshot - Keep the last frame on disk and show it at the next start until the\n \
+                      child draws, frames unused for 30 days are removed\n \
+            -snapshot-dir - Where -snapshot keeps frames (default is ~/.cache/xwinwrap)\n \
+            -control - Take commands on this Unix socket, see xwinwrapctl\n \
+            -metrics - Write child CPU, memory, frame rate and pixmap usage to this file every\n \
+                      10 seconds, in the Prometheus text format (also the metrics command of\n \
+                      -control)\n \
+            -pixmap-max - Warn when the child's X client holds more pixmap memory than this\n \
+                      (ex: -pixmap-max 512M)\n \
+            -pixmap-restart - Restart the child in place instead when it goes over -pixmap-max\n \
+            -rootpmap - Publish the window as the root pixmap for pseudo-transparent clients,\n \
+                      updated at most RATE times a second (ex: -rootpmap 2)\n \
+            -image  - Play this animated GIF instead of running a command\n \
+            -image-mem - Pixmap memory in MiB before -image keeps only changes between frames\n \
+                      (default %d)\n \
+            -stream - Show raw BGRA frames read from this pipe, - for stdin, and exit at its end\n \
+                      (ex: ffmpeg -f rawvideo -pix_fmt bgra)\n \
+            -stream-size - Size of the -stream frames (default is the window size)\n \
+            -debug  - Enable debug messages\n \
+            -trace  - Report time, X round trips and requests of each startup phase\n",
+        WID_PLACEHOLDER, POWER_ROOT, PLAYLIST_INTERVAL, IMAGE_BUDGET);
+    exit(1);
+}
+
+#ifdef HAVE_X11_XCB
+/* The tree walks below issue every request for one level of the tree at once
+ * and collect the replies afterwards, so discovery costs a round trip per
+ * level instead of one (or two, for XGetWindowAttributes) per window. */
+
+static Window find_subwindow(Window win, int w, int h) {
+    xcb_connection_t *c = XGetXCBConnection(display);
+    unsigned int i;
+    int j, n;
+
+    /* requests queued by Xlib go out before ours */
+    XFlush(display);
+
+    /* search subwindows with same size as display or work area */
+
+    for (i = 0; i < 10; i++) {
+        xcb_query_tree_cookie_t tree_cookie;
+        xcb_query_tree_reply_t *tree;
+        xcb_window_t *children;
+        xcb_get_window_attributes_cookie_t *attr_cookies;
+        xcb_get_geometry_cookie_t *geom_cookies;
+        Window found = 0;
+
+        tree_cookie = xcb_query_tree(c, win);
+        trace_xcb_request = tree_cookie.sequence;
+        round_trips++;
+        tree = xcb_query_tree_reply(c, tree_cookie, NULL);
+        if (!tree)
+            break;
+
+        n = xcb_query_tree_children_length(tree);
+        children = xcb_query_tree_children(tree);
+        attr_cookies = malloc(n * sizeof(*attr_cookies));
+        geom_cookies = malloc(n * sizeof(*geom_cookies));
+
+        for (j = 0; j < n; j++) {
+            attr_cookies[j] = xcb_get_window_attributes(c, children[j]);
+            geom_cookies[j] = xcb_get_geometry(c, children[j]);
+            trace_xcb_request = geom_cookies[j].sequence;
+        }
+        if (n > 0)
+            round_trips++;
+
+        for (j = 0; j < n; j++) {
+            xcb_get_window_attributes_reply_t *attrs;
+            xcb_get_geometry_reply_t *geom;
+
+            if (found) {
+                xcb_discard_reply(c, attr_cookies[j].sequence);
+                xcb_discard_reply(c, geom_cookies[j].sequence);
+                continue;
+            }
+
+            attrs = xcb_get_window_attributes_reply(c, attr_cookies[j], NULL);
+            geom = xcb_get_geometry_reply(c, geom_cookies[j], NULL);
+
+            /* Window must be mapped and same size as display or
+             * work space */
+            if (attrs && geom && attrs->map_state != XCB_MAP_STATE_UNMAPPED
+                && ((geom->width == display_width && geom->height == display_height)
+                    || (geom->width == w && geom->height == h))) {
+                found = children[j];
+            }
+
+            free(attrs);
+            free(geom);
+        }
+
+        free(attr_cookies);
+        free(geom_cookies);
+        free(tree);
+
+        if (!found)
+            break;
+        win = found;
+    }
+
+    return win;
+}
+
+/* some window managers set __SWM_VROOT to some child of root window */
+static Window find_vroot(Window root) {
+    xcb_connection_t *c = XGetXCBConnection(display);
+    xcb_atom_t vroot = ATOM(__SWM_VROOT);
+    xcb_query_tree_cookie_t tree_cookie;
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    xcb_get_property_cookie_t *cookies;
+    Window win = 0;
+    int i, n;
+
+    tree_cookie = xcb_query_tree(c, root);
+    trace_xcb_request = tree_cookie.sequence;
+    round_trips++;
+    tree = xcb_query_tree_reply(c, tree_cookie, NULL);
+    if (!tree)
+        return 0;
+
+    n = xcb_query_tree_children_length(tree);
+    children = xcb_query_tree_children(tree);
+    cookies = malloc(n * sizeof(*cookies));
+
+    for (i = 0; i < n; i++)
+        cookies[i] = xcb_get_property(c, 0, children[i], vroot, XCB_ATOM_WINDOW, 0, 1);
+    if (n > 0) {
+        trace_xcb_request = cookies[n - 1].sequence;
+        round_trips++;
+    }
+
+    for (i = 0; i < n; i++) {
+        xcb_get_property_reply_t *prop;
+
+        if (win) {
+            xcb_discard_reply(c, cookies[i].sequence);
+            continue;
+        }
+
+        prop = xcb_get_property_reply(c, cookies[i], NULL);
+        if (prop && prop->type == XCB_ATOM_WINDOW && xcb_get_property_value_length(prop) >= 4)
+            win = *(xcb_window_t *) xcb_get_property_value(prop);
+        free(prop);
+    }
+
+    free(cookies);
+    free(tree);
+
+    return win;
+}
+#else
+static Window find_subwindow(Window win, int w, int h) {
+    unsigned int i, j;
+    Window troot, parent, *children;
+    unsigned int n;
+
+    /* search subwindows with same size as display or work area */
+
+    for (i = 0; i < 10; i++) {
+        round_trips++;
+        XQueryTree(display, win, &troot, &parent, &children, &n);
+
+        for (j = 0; j < n; j++) {
+            XWindowAttributes attrs;
+
+            round_trips += 2;
+            if (XGetWindowAttributes(display, children[j], &attrs)) {
+                /* Window must be mapped and same size as display or
+                 * work space */
+                if (attrs.map_state != 0
+                    && ((attrs.width == display_width && attrs.height == display_height)
+                        || (attrs.width == w && attrs.height == h))) {
+                    win = children[j];
+                    break;
+                }
+            }
+        }
+
+        XFree(children);
+        if (j == n) {
+            break;
+        }
+    }
+
+    return win;
+}
+
+/* some window managers set __SWM_VROOT to some child of root window */
+static Window find_vroot(Window root) {
+    Atom type;
+    int format, i;
+    unsigned long nitems, bytes;
+    unsigned int n;
+    Window win = 0;
+    Window troot, parent, *children;
+    unsigned char *buf = NULL;
+
+    round_trips++;
+    XQueryTree(display, root, &troot, &parent, &children, &n);
+    for (i = 0; i < (int) n && !win; i++) {
+        round_trips++;
+        if (XGetWindowProperty(display, children[i], ATOM(__SWM_VROOT), 0, 1, False, XA_WINDOW,
+                &type, &format, &nitems, &bytes, &buf)
+                == Success
+            && type == XA_WINDOW) {
+            win = *(Window *) buf;
+        }
+
+        if (buf) {
+            XFree(buf);
+            buf = 0;
+        }
+    }
+    XFree(children);
+
+    return win;
+}
+#endif
+
+static Window find_desktop_window(Window *p_root, Window *p_desktop) {
+    Window root = RootWindow(display, screen);
+    Window win;
+
+    if (!p_root || !p_desktop) {
+        return 0;
+    }
+
+    win = find_vroot(root);
+    if (win) {
+        if (debug) {
+            fprintf(stderr, NAME ": desktop window (%lx) found from __SWM_VROOT property\n", win);
+        }
+        fflush(stderr);
+        *p_root = win;
+        *p_desktop = win;
+        return win;
+    }
+
+    /* get subwindows from root */
+    win = find_subwindow(root, -1, -1);
+
+    display_width = DisplayWidth(display, screen);
+    display_height = DisplayHeight(display, screen);
+
+    win = find_subwindow(win, display_width, display_height);
+
+    if (win != root && debug) {
+        fprintf(
+            stderr, NAME ": desktop window (%lx) is subwindow of root window (%lx)\n", win, root);
+    } else if (debug) {
+        fprintf(stderr, NAME ": desktop window (%lx) is root window\n", win);
+    }
+
+    fflush(stderr);
+
+    *p_root = root;
+    *p_desktop = win;
+
+    return win;
+}
+
+static void select_root_input(long mask) {
+    root_event_mask |= mask;
+    XSelectInput(display, RootWindow(display, screen), root_event_mask);
+}
+
+static bool pid_in_tree(pid_t p) {
+    int i;
+
+    for (i = 0; i < ntree_pids; i++)
+        if (tree_pids[i] == p)
+            return true;
+    return false;
+}
+
+/* Collect the child and all of its descendants from /proc, launchers such
+ * as mpv wrappers fork before mapping their window. */
+static void update_pid_tree() {
+    DIR *dir;
+    struct dirent *de;
+    pid_t *ppids = NULL, *pids = NULL;
+    int n = 0, cap = 0, i;
+    bool grown;
+
+    ntree_pids = 0;
+    if (tree_pids_cap == 0) {
+        tree_pids_cap = 16;
+        tree_pids = malloc(tree_pids_cap * sizeof(pid_t));
+    }
+    tree_pids[ntree_pids++] = window.pid;
+
+    dir = opendir("/proc");
+    if (!dir)
+        return;
+
+    while ((de = readdir(dir)) != NULL) {
+        char path[sizeof(de->d_name) + 16], stat[512], *p;
+        pid_t ppid;
+        ssize_t len;
+        int fd;
+
+        if (de->d_name[0] < '0' || de->d_name[0] > '9')
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        len = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        if (len <= 0)
+            continue;
+        stat[len] = '\0';
+
+        /* "pid (comm) state ppid ...", comm may contain spaces */
+        p = strrchr(stat, ')');
+        if (!p || sscanf(p + 1, " %*c %d", &ppid) != 1)
+            continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            pids = realloc(pids, cap * sizeof(pid_t));
+            ppids = realloc(ppids, cap * sizeof(pid_t));
+        }
+        pids[n] = atoi(de->d_name);
+        ppids[n] = ppid;
+        n++;
+    }
+    closedir(dir);
+
+    do {
+        grown = false;
+        for (i = 0; i < n; i++) {
+            if (!pid_in_tree(ppids[i]) || pid_in_tree(pids[i]))
+                continue;
+            if (ntree_pids == tree_pids_cap) {
+                tree_pids_cap *= 2;
+                tree_pids = realloc(tree_pids, tree_pids_cap * sizeof(pid_t));
+            }
+            tree_pids[ntree_pids++] = pids[i];
+            grown = true;
+        }
+    } while (grown);
+
+    free(pids);
+    free(ppids);
+}
+
+static bool is_child_window(Window w) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytes;
+    unsigned char *buf = NULL;
+    bool match = false;
+
+    round_trips++;
+    if (XGetWindowProperty(display, w, ATOM(_NET_WM_PID), 0, 1, False, XA_CARDINAL, &type,
+            &format, &nitems, &bytes, &buf)
+            == Success
+        && buf) {
+        if (type == XA_CARDINAL && nitems == 1) {
+            pid_t wpid = (pid_t) * (unsigned long *) buf;
+
+            if (!pid_in_tree(wpid))
+                update_pid_tree();
+            match = pid_in_tree(wpid);
+        }
+        XFree(buf);
+    }
+
+    if (!match && attach_class) {
+        XClassHint hint;
+
+        round_trips++;
+        if (XGetClassHint(display, w, &hint)) {
+            match = (hint.res_name && strcmp(hint.res_name, attach_class) == 0)
+                || (hint.res_class && strcmp(hint.res_class, attach_class) == 0);
+            XFree(hint.res_name);
+            XFree(hint.res_class);
+        }
+    }
+
+    return match;
+}
+
+/* Top-level windows are watched for _NET_WM_PID and WM_CLASS from the moment
+ * they are created, so the child is attached as soon as it announces itself
+ * instead of being searched for periodically. */
+static void watch_toplevel(Window w) {
+    if (nwatched == watched_cap) {
+        watched_cap = watched_cap ? watched_cap * 2 : 64;
+        watched = realloc(watched, watched_cap * sizeof(Window));
+    }
+    watched[nwatched++] = w;
+    XSelectInput(display, w, PropertyChangeMask);
+}
+
+static void on_attach_timeout(void *data) {
+    if (!attaching)
+        return;
+    fprintf(stderr, "could not find any child window");
+    running = false;
+}
+
+#ifdef HAVE_XDAMAGE
+/* -playlist: every rotation the next command is started early into a new
+ * inner window, redirected offscreen so it can draw unseen. Its first damage
+ * after its window was mapped swaps it in, and only then the previous child
+ * is terminated. */
+static void playlist_spawn(struct window *w) {
+    playlist_argv[2] = playlist[playlist_pos];
+    spawn_child(w);
+}
+
+static void on_rotate_timer(void *data) {
+    XSetWindowAttributes attrs;
+
+    if (warm.pid > 0 || stopping)
+        return;
+
+    playlist_pos = (playlist_pos + 1) % nplaylist;
+    if (debug)
+        fprintf(stderr, NAME ": warming up %s\n", playlist[playlist_pos]);
+
+    memset(&warm, 0, sizeof(warm));
+    warm.root = window.root;
+    warm.window = window.window;
+    warm.visual = window.visual;
+    warm.colourmap = window.colourmap;
+    warm.width = window.width;
+    warm.height = window.height;
+    warm.pidfd = -1;
+    playlist_armed = 0;
+
+    /* like create_inner(), but redirected before it is mapped */
+    attrs.event_mask = StructureNotifyMask | SubstructureNotifyMask;
+    warm.inner = XCreateWindow(display, window.window, 0, 0, window.width, window.height, 0,
+        CopyFromParent, InputOutput, CopyFromParent, CWEventMask, &attrs);
+    XCompositeRedirectWindow(display, warm.inner, CompositeRedirectManual);
+    XMapWindow(display, warm.inner);
+    warm.damage = XDamageCreate(display, warm.inner, XDamageReportNonEmpty);
+    playlist_spawn(&warm);
+}
+
+/* The child's window is mapped, what it damages from now on is its own
+ * drawing rather than the background of the new window. */
+static void playlist_arm() {
+    playlist_armed = NextRequest(display);
+    XDamageSubtract(display, warm.damage, None, None);
+}
+
+static void playlist_swap() {
+    Window old_inner = window.inner;
+    pid_t old_pid = window.pid;
+    int old_pidfd = window.pidfd;
+
+    XGrabServer(display);
+    XCompositeUnredirectWindow(display, warm.inner, CompositeRedirectManual);
+    XRaiseWindow(display, warm.inner);
+    XDestroyWindow(display, old_inner);
+    XUngrabServer(display);
+    XDamageDestroy(display, warm.damage);
+    if (debug)
+        fprintf(stderr, NAME ": switched to %s after %lu ms\n", playlist[playlist_pos],
+            (unsigned long) (now_ms() - warm.started));
+
+    /* the wrapper takes over the new child, warm the old one until it is
+     * reaped */
+    if (window.pidfd >= 0)
+        unwatch_fd(window.pidfd);
+    if (warm.pidfd >= 0) {
+        unwatch_fd(warm.pidfd);
+        watch_fd(warm.pidfd, POLLIN, on_child_exit, &window);
+    }
+    window.pid = warm.pid;
+    window.pidfd = warm.pidfd;
+    window.started = warm.started;
+    window.inner = warm.inner;
+    window.child = warm.child;
+    window.damage = 0;
+    watch_damage(&window);
+    if (window.paused)
+        kill(-window.pid, SIGSTOP);
+
+    warm.pid = old_pid;
+    warm.pidfd = old_pidfd;
+    warm.inner = warm.child = 0;
+    warm.damage = 0;
+    if (old_pidfd >= 0)
+        watch_fd(old_pidfd, POLLIN, on_child_exit, &warm);
+    if (old_pid > 0) {
+        kill(-old_pid, SIGTERM);
+        kill(-old_pid, SIGCONT);
+    }
+
+    set_timer(on_rotate_timer, NULL, rotate_ms);
+}
+
+/* Called from reap_child() when the warm child exited, either the one
+ * replaced or a new one that died before it drew anything. */
+static void warm_exited() {
+    if (!warm.inner)
+        return;
+    fprintf(stderr, NAME ": %s exited before drawing, skipped\n", playlist[playlist_pos]);
+    XDamageDestroy(display, warm.damage);
+    XDestroyWindow(display, warm.inner);
+    warm.inner = 0;
+    warm.damage = 0;
+    set_timer(on_rotate_timer, NULL, rotate_ms);
+}
+
+/* At exit, a command still warming up or being replaced is given a second
+ * to terminate before it is killed, it is never left running offscreen. */
+static void playlist_stop() {
+    int i;
+
+    if (warm.pid <= 0)
+        return;
+    kill(-warm.pid, SIGTERM);
+    kill(-warm.pid, SIGCONT);
+    for (i = 0; i < 20 && waitpid(warm.pid, NULL, WNOHANG) == 0; i++)
+        usleep(50000);
+    if (i == 20) {
+        kill(-warm.pid, SIGKILL);
+        waitpid(warm.pid, NULL, 0);
+    }
+    warm.pid = 0;
+}
+
+static void playlist_load(const char *path) {
+    char line[4096];
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        die("Couldn't open %s:", path);
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!line[0] || line[0] == '#')
+            continue;
+        playlist = realloc(playlist, (nplaylist + 1) * sizeof(char *));
+        playlist[nplaylist++] = strdup(line);
+    }
+    fclose(f);
+    if (!nplaylist)
+        die("%s has no commands.", path);
+
+    playlist_argv[2] = playlist[0];
+    child_argv = playlist_argv;
+    child_argc = 3;
+}
+#endif
+
+static void on_restart_timer(void *data) {
+    struct window *w = data;
+
+    w->restarting = false;
+    spawn_child(w);
+    /* -fa looks for the new child's window again */
+    if (force_attach) {
+        attaching = true;
+        set_timer(on_attach_timeout, NULL, ATTACH_TIMEOUT);
+    }
+}
+
+static void try_attach(Window w) {
+    int i;
+
+    if (!attaching || !is_child_window(w))
+        return;
+
+    attaching = false;
+    cancel_timer(on_attach_timeout, NULL);
+    window.child = w;
+    if (debug)
+        fprintf(stderr, NAME ": found child window (%lx)\n", w);
+
+    for (i = 0; i < nwatched; i++)
+        XSelectInput(display, watched[i], NoEventMask);
+    free(watched);
+    watched = NULL;
+    nwatched = watched_cap = 0;
+
+    XReparentWindow(display, window.child, window.inner, 0, 0);
+    XResizeWindow(display, window.child, scaled(window.width), scaled(window.height));
+#ifdef HAVE_XDAMAGE
+    watch_damage(&window);
+    if (!have_damage)
+#endif
+        child_drew(&window);
+
+    XMapWindow(display, window.window);
+#ifdef HAVE_XDAMAGE
+    /* an offscreen source only becomes viewable now */
+    if (mirror.source)
+        mirror_bind_source();
+#endif
+    round_trips++;
+    XSync(display, False);
+    trace_phase("attach");
+}
+
+/* Work out whether any part of w is still visible by subtracting the
+ * geometry of every viewable client stacked above it, as listed in
+ * _NET_CLIENT_LIST_STACKING (bottom to top). VisibilityNotify is not used
+ * because it is never delivered for redirected windows under a compositor. */
+static bool window_covered(struct window *w, Window *clients, unsigned long nitems) {
+    Window root = RootWindow(display, screen), dummy;
+    XWindowAttributes attrs;
+    XRectangle rect;
+    Region visible;
+    unsigned long i;
+    int x, y;
+    bool stacked_above, covered;
+
+    round_trips += 2;
+    if (!XGetWindowAttributes(display, w->window, &attrs) || attrs.map_state != IsViewable)
+        return true;
+
+    round_trips++;
+    XTranslateCoordinates(display, w->window, root, 0, 0, &x, &y, &dummy);
+    rect.x = x;
+    rect.y = y;
+    rect.width = attrs.width;
+    rect.height = attrs.height;
+    visible = XCreateRegion();
+    XUnionRectWithRegion(&rect, visible, visible);
+
+    /* a window not managed by the WM (override, desktop child) is below all
+     * clients */
+    for (i = 0; i < nitems && clients[i] != w->window; i++)
+        ;
+    stacked_above = i == nitems;
+
+    for (i = 0; i < nitems && !XEmptyRegion(visible); i++) {
+        Region r;
+
+        if (!stacked_above) {
+            stacked_above = clients[i] == w->window;
+            continue;
+        }
+        round_trips += 2;
+        if (!XGetWindowAttributes(display, clients[i], &attrs) || attrs.map_state != IsViewable)
+            continue;
+        round_trips++;
+        if (!XTranslateCoordinates(display, clients[i], root, 0, 0, &x, &y, &dummy))
+            continue;
+
+        rect.x = x - attrs.border_width;
+        rect.y = y - attrs.border_width;
+        rect.width = attrs.width + 2 * attrs.border_width;
+        rect.height = attrs.height + 2 * attrs.border_width;
+
+        r = XCreateRegion();
+        XUnionRectWithRegion(&rect, r, r);
+        XSubtractRegion(visible, r, visible);
+        XDestroyRegion(r);
+    }
+
+    covered = XEmptyRegion(visible);
+    XDestroyRegion(visible);
+
+    return covered;
+}
+
+/* Stop the child of every window that is fully covered. */
+static void update_visibility() {
+    Atom type;
+    int format, i;
+    unsigned long nitems, bytes;
+    unsigned char *buf = NULL;
+
+    visibility_dirty = false;
+
+    round_trips++;
+    if (XGetWindowProperty(display, RootWindow(display, screen), ATOM(_NET_CLIENT_LIST_STACKING),
+            0, 0x7fffffff, False, XA_WINDOW, &type, &format, &nitems, &bytes, &buf)
+            != Success
+        || type != XA_WINDOW) {
+        nitems = 0;
+    }
+
+    for (i = 0; i < nwindows; i++) {
+        struct window *w = windows[i];
+        bool covered = window_covered(w, (Window *) buf, nitems);
+
+        if (debug && covered != !!(w->paused & PAUSE_COVERED))
+            fprintf(stderr, NAME ": window %lx %s\n", w->window,
+                covered ? "fully covered" : "visible");
+        set_paused(w, PAUSE_COVERED, covered);
+    }
+
+    if (buf)
+        XFree(buf);
+}
+
+static struct window *find_window(Window xid) {
+    int i;
+
+    for (i = 0; i < nwindows; i++)
+        if (windows[i]->window == xid || windows[i]->inner == xid)
+            return windows[i];
+    return NULL;
+}
+
+static void on_dpms_timer(void *data) {
+    CARD16 level;
+    BOOL enabled;
+    bool off;
+    int i;
+
+    round_trips++;
+    off = DPMSInfo(display, &level, &enabled) && enabled && level != DPMSModeOn;
+    for (i = 0; i < nwindows; i++)
+        set_paused(windows[i], PAUSE_DPMS, off);
+
+    set_timer(on_dpms_timer, NULL, DPMS_INTERVAL);
+}
+
+#ifdef HAVE_XSS
+/* -idle: once there was no input for idle_ms, the child only runs for
+ * IDLE_RUN_MS out of every IDLE_RUN_MS + IDLE_STOP_MS. The server has no
+ * event for input resuming, so the idle time is polled while idle and
+ * otherwise checked when the threshold could first be reached. */
+static void on_idle_duty(void *data) {
+    int i;
+
+    idle_stopped = !idle_stopped;
+    for (i = 0; i < nwindows; i++)
+        set_paused(windows[i], PAUSE_IDLE, idle_stopped);
+    set_timer(on_idle_duty, NULL, idle_stopped ? IDLE_STOP_MS : IDLE_RUN_MS);
+}
+
+static void on_idle_timer(void *data) {
+    static XScreenSaverInfo *info = NULL;
+    bool idle;
+    int i;
+
+    if (!info)
+        info = XScreenSaverAllocInfo();
+    round_trips++;
+    if (!XScreenSaverQueryInfo(display, RootWindow(display, screen), info))
+        return;
+
+    idle = info->idle >= idle_ms;
+    if (idle != idling) {
+        idling = idle;
+        if (debug)
+            fprintf(stderr, NAME ": session %s\n", idle ? "idle, slowing down" : "active");
+        if (idle) {
+            on_idle_duty(NULL);
+        } else {
+            cancel_timer(on_idle_duty, NULL);
+            idle_stopped = false;
+            for (i = 0; i < nwindows; i++)
+                set_paused(windows[i], PAUSE_IDLE, false);
+        }
+    }
+
+    set_timer(on_idle_timer, NULL, idle ? IDLE_POLL : idle_ms - info->idle);
+}
+
+static void screen_saver_changed(bool on) {
+    int i;
+
+    if (debug)
+        fprintf(stderr, NAME ": screen saver %s\n", on ? "on" : "off");
+    for (i = 0; i < nwindows; i++)
+        set_paused(windows[i], PAUSE_BLANKED, on);
+}
+#endif
+
+#ifdef HAVE_XRANDR
+/* -per-output: one window and child per active CRTC. The first output uses
+ * the window struct, the others share its root, desktop and visual. */
+static struct window *add_output(RRCrtc crtc, int x, int y, unsigned int width,
+    unsigned int height) {
+    struct window *w = &window;
+
+    if (window.crtc) {
+        if (nwindows == MAX_WINDOWS)
+            return NULL;
+        /* Only the configuration is shared, the rest starts out zero. */
+        w = calloc(1, sizeof(*w));
+        if (!w)
+            return NULL;
+        w->root = window.root;
+        w->desktop = window.desktop;
+        w->visual = window.visual;
+        w->colourmap = window.colourmap;
+        w->pidfd = -1;
+        windows[nwindows++] = w;
+    }
+
+    w->crtc = crtc;
+    w->x = x;
+    w->y = y;
+    w->width = width;
+    w->height = height;
+
+    if (debug)
+        fprintf(stderr, NAME ": output crtc %lx at %ux%u+%d+%d\n", crtc, width, height, x, y);
+
+    return w;
+}
 
-    /* search subwindows with same size as display or work area */
+static void init_outputs() {
+    XRRScreenResources *res;
+    int i;
 
-    for (i = 0; i < 10; i++) {
-        XQueryTree(display, win, &troot, &parent, &children, &n);
+    if (!have_xrandr)
+        die("-per-output needs the RandR extension.");
 
-        for (j = 0; j < n; j++) {
-            XWindowAttributes attrs;
+    round_trips++;
+    res = XRRGetScreenResourcesCurrent(display, RootWindow(display, screen));
+    if (!res)
+        die("Couldn't get screen resources.");
 
-            if (XGetWindowAttributes(display, children[j], &attrs)) {
-                /* Window must be mapped and same size as display or
-                 * work space */
-                if (attrs.map_state != 0
-                    && ((attrs.width == display_width && attrs.height == display_height)
-                        || (attrs.width == w && attrs.height == h))) {
-                    win = children[j];
-                    break;
-                }
-            }
-        }
+    for (i = 0; i < res->ncrtc; i++) {
+        XRRCrtcInfo *ci;
 
-        XFree(children);
-        if (j == n) {
-            break;
-        }
+        round_trips++;
+        ci = XRRGetCrtcInfo(display, res, res->crtcs[i]);
+        if (!ci)
+            continue;
+        if (ci->mode != None && ci->noutput > 0)
+            add_output(res->crtcs[i], ci->x, ci->y, ci->width, ci->height);
+        XRRFreeCrtcInfo(ci);
     }
+    XRRFreeScreenResources(res);
 
-    return win;
+    if (!window.crtc)
+        die("No active outputs found.");
 }
 
-static Window find_desktop_window(Window *p_root, Window *p_desktop) {
-    Atom type;
-    int format, i;
-    unsigned long nitems, bytes;
-    unsigned int n;
-    Window root = RootWindow(display, screen);
-    Window win = root;
-    Window troot, parent, *children;
-    unsigned char *buf = NULL;
+/* A CRTC was moved, resized, switched off or on. Children of disabled
+ * outputs are stopped, newly enabled outputs get a window and child. */
+static void crtc_changed(XRRCrtcChangeNotifyEvent *ce) {
+    struct window *w = NULL;
+    int i;
 
-    if (!p_root || !p_desktop) {
-        return 0;
+    for (i = 0; i < nwindows; i++)
+        if (windows[i]->crtc == ce->crtc)
+            w = windows[i];
+
+    if (ce->mode == None || ce->width == 0 || ce->height == 0) {
+        if (w)
+            set_paused(w, PAUSE_OUTPUT_OFF, true);
+        return;
     }
 
-    /* some window managers set __SWM_VROOT to some child of root window */
+    if (!w) {
+        w = add_output(ce->crtc, ce->x, ce->y, ce->width, ce->height);
+        if (!w)
+            return;
+        create_window(w);
+        XMapWindow(display, w->window);
+#ifdef HAVE_XDAMAGE
+        if (rootpmap.pixmap)
+            rootpmap_add_window(w);
+#endif
+        if (mirror_outputs)
+            mirror_add_target(w);
+        else
+            spawn_child(w);
+        visibility_dirty = true;
+        return;
+    }
 
-    XQueryTree(display, root, &troot, &parent, &children, &n);
-    for (i = 0; i < (int) n; i++) {
-        if (XGetWindowProperty(display, children[i], ATOM(__SWM_VROOT), 0, 1, False, XA_WINDOW,
-                &type, &format, &nitems, &bytes, &buf)
-                == Success
-            && type == XA_WINDOW) {
-            win = *(Window *) buf;
-            XFree(buf);
-            XFree(children);
-            if (debug) {
-                fprintf(
-                    stderr, NAME ": desktop window (%lx) found from __SWM_VROOT property\n", win);
-            }
-            fflush(stderr);
-            *p_root = win;
-            *p_desktop = win;
-            return win;
-        }
+    resize_window(w, ce->x, ce->y, ce->width, ce->height);
+    set_paused(w, PAUSE_OUTPUT_OFF, false);
+}
+#else
+static void init_outputs() {
+    die("-per-output needs xwinwrap built with Xrandr.");
+}
+#endif
 
-        if (buf) {
-            XFree(buf);
-            buf = 0;
+static void handle_event(XEvent *ev) {
+    switch (ev->type) {
+    case CreateNotify: {
+        struct window *w = find_window(ev->xcreatewindow.parent);
+
+        if (w && !w->child) {
+            w->child = ev->xcreatewindow.window;
+            if (debug)
+                fprintf(stderr, NAME ": child created window (%lx)\n", w->child);
+#ifdef HAVE_XDAMAGE
+            watch_damage(w);
+            /* without damage, having a window is as close as it gets */
+            if (!have_damage)
+#endif
+                child_drew(w);
+            trace_phase("attach");
+        }
+#ifdef HAVE_XDAMAGE
+        if (warm.inner && ev->xcreatewindow.parent == warm.inner && !warm.child)
+            warm.child = ev->xcreatewindow.window;
+#endif
+        if (attaching && ev->xcreatewindow.parent == RootWindow(display, screen)) {
+            watch_toplevel(ev->xcreatewindow.window);
+            try_attach(ev->xcreatewindow.window);
         }
+        break;
     }
-    XFree(children);
+    case ConfigureNotify:
+        if (ev->xconfigure.window == RootWindow(display, screen)) {
+#ifdef HAVE_XRANDR
+            if (have_xrandr)
+                XRRUpdateConfiguration(ev);
+#endif
+            screen_changed(ev->xconfigure.width, ev->xconfigure.height);
+            break;
+        }
+#ifdef HAVE_XDAMAGE
+        {
+            int i;
 
-    /* get subwindows from root */
-    win = find_subwindow(root, -1, -1);
+            /* a frozen child is resized by resize_window(), let it redraw */
+            for (i = 0; i < nwindows; i++)
+                if (windows[i]->child == ev->xconfigure.window)
+                    thaw(windows[i]);
+        }
+#endif
+        visibility_dirty = true;
+        break;
+    case Expose: {
+        struct window *w = find_window(ev->xexpose.window);
 
-    display_width = DisplayWidth(display, screen);
-    display_height = DisplayHeight(display, screen);
+        if (w && image.nframes && ev->xexpose.count == 0)
+            image_draw(w, 0, 0, image.width, image.height);
+        if (w && stream.images[0] && stream.state[stream.shown] == STREAM_SHOWN
+            && ev->xexpose.count == 0)
+            stream_put(w, stream.shown);
+#ifdef HAVE_XDAMAGE
+        /* targets are redrawn from the source, not by a child */
+        if (w && w->picture)
+            mirror_damage(0, 0, mirror.width, mirror.height);
+#endif
+        break;
+    }
+    case MapNotify:
+#ifdef HAVE_XDAMAGE
+        if (mirror.source && ev->xmap.window == mirror.source)
+            mirror_bind_source();
+        if (warm.child && ev->xmap.window == warm.child && !playlist_armed)
+            playlist_arm();
+#endif
+        visibility_dirty = true;
+        break;
+    case DestroyNotify: {
+        int i;
 
-    win = find_subwindow(win, display_width, display_height);
+        /* the child closed its window but may open another one, which is
+         * then adopted like the first */
+        for (i = 0; i < nwindows; i++) {
+            struct window *w = windows[i];
 
-    if (buf) {
-        XFree(buf);
-        buf = 0;
+            if (!w->child || w->child != ev->xdestroywindow.window)
+                continue;
+            if (debug)
+                fprintf(stderr, NAME ": child window %lx destroyed\n", w->child);
+            w->child = 0;
+#ifdef HAVE_XDAMAGE
+            if (w->damage)
+                XDamageDestroy(display, w->damage);
+            w->damage = 0;
+#endif
+            if (force_attach && w == &window)
+                attaching = true;
+        }
+        visibility_dirty = true;
+        break;
     }
+    case UnmapNotify:
+    case ReparentNotify: visibility_dirty = true; break;
+    case PropertyNotify:
+        if (ev->xproperty.atom == ATOM(_NET_CLIENT_LIST_STACKING))
+            visibility_dirty = true;
+        else if (ev->xproperty.atom == ATOM(_NET_WM_PID) || ev->xproperty.atom == XA_WM_CLASS)
+            try_attach(ev->xproperty.window);
+        break;
+    default:
+#ifdef HAVE_XSS
+        if (have_xss && ev->type == xss_event_base + ScreenSaverNotify) {
+            screen_saver_changed(((XScreenSaverNotifyEvent *) ev)->state == ScreenSaverOn);
+            break;
+        }
+#endif
+        if (stream.images[0] && ev->type == stream.completion) {
+            stream.pending--;
+            break;
+        }
+#ifdef HAVE_XDAMAGE
+        if (have_damage && ev->type == damage_event_base + XDamageNotify) {
+            XDamageNotifyEvent *de = (XDamageNotifyEvent *) ev;
+            int i;
 
-    if (win != root && debug) {
-        fprintf(
-            stderr, NAME ": desktop window (%lx) is subwindow of root window (%lx)\n", win, root);
-    } else if (debug) {
-        fprintf(stderr, NAME ": desktop window (%lx) is root window\n", win);
+            if (de->damage == mirror.damage)
+                mirror_damage(de->area.x, de->area.y, de->area.width, de->area.height);
+            if (de->damage == warm.damage && playlist_armed && de->serial >= playlist_armed) {
+                playlist_swap();
+                break;
+            }
+            for (i = 0; i < nwindows; i++) {
+                if (de->damage != windows[i]->damage)
+                    continue;
+                windows[i]->damaged = true;
+                windows[i]->snapshot_damaged = true;
+                child_drew(windows[i]);
+                /* with -max-fps, -metrics and -rootpmap every frame causes an
+                 * event */
+                if (max_fps || metrics_path || rootpmap.rate) {
+                    windows[i]->frames++;
+                    windows[i]->frames_total++;
+                    XDamageSubtract(
+                        display, de->damage, None, rootpmap.rate ? rootpmap.parts : None);
+                    if (rootpmap.rate)
+                        rootpmap_damaged(windows[i]);
+                }
+            }
+            break;
+        }
+#endif
+#ifdef HAVE_XRANDR
+        if (have_xrandr
+            && (ev->type == xrandr_event_base + RRScreenChangeNotify
+                || ev->type == xrandr_event_base + RRNotify)) {
+            XRRUpdateConfiguration(ev);
+            if (per_output && ev->type == xrandr_event_base + RRNotify
+                && ((XRRNotifyEvent *) ev)->subtype == RRNotify_CrtcChange)
+                crtc_changed((XRRCrtcChangeNotifyEvent *) ev);
+            screen_changed(DisplayWidth(display, screen), DisplayHeight(display, screen));
+        }
+#endif
+        break;
     }
+}
 
-    fflush(stderr);
+/* Multiplex the X connection with the watched file descriptors and timers,
+ * sleeping in poll() until one of them needs attention. */
+static void run_loop(bool pause_covered) {
+    struct pollfd fds[MAX_WATCHES + 1];
+    struct watch ready[MAX_WATCHES];
+    int i, n;
 
-    *p_root = root;
-    *p_desktop = win;
+    while (running) {
+        while (XPending(display)) {
+            XEvent ev;
 
-    return win;
-}
+            XNextEvent(display, &ev);
+            handle_event(&ev);
+        }
+        /* the window is only mapped once the child has been attached */
+        if (pause_covered && visibility_dirty && !attaching)
+            update_visibility();
+#ifdef HAVE_XDAMAGE
+        mirror_flush();
+#endif
+        stream_flush();
+        XFlush(display);
 
-static Window find_child_window(pid_t pid) {
-    Atom type;
-    int format, i;
-    unsigned long nitems, bytes;
-    unsigned int n;
-    Window root = RootWindow(display, screen);
-    Window win = root;
-    Window troot, parent, *children;
-    unsigned char *buf = NULL;
-    pid_t currpid;
+        if (!running)
+            break;
 
-    XQueryTree(display, root, &troot, &parent, &children, &n);
-    for (i = 0; i < (int) n; i++) {
-        int success
-            = XGetWindowProperty(display, children[i], XInternAtom(display, "_NET_WM_PID", True), 0,
-                1, False, XA_CARDINAL, &type, &format, &nitems, &bytes, &buf);
-        if (buf == 0) {
-            continue;
-        }
-        currpid = *((pid_t *) buf);
-        if (success == Success && currpid == pid) {
-            win = children[i];
-            XFree(buf);
-            XFree(children);
-            if (debug) {
-                fprintf(stderr, NAME ": found child window (%lx)\n", win);
-            }
-            fflush(stderr);
-            return win;
+        fds[0].fd = ConnectionNumber(display);
+        fds[0].events = POLLIN;
+        for (i = 0; i < nwatches; i++) {
+            fds[i + 1].fd = watches[i].fd;
+            fds[i + 1].events = watches[i].events;
+            ready[i] = watches[i];
         }
+        n = nwatches;
 
-        if (buf) {
-            XFree(buf);
-            buf = 0;
+        if (poll(fds, n + 1, next_timeout()) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll failed:");
         }
-    }
-    XFree(children);
 
-    return 0;
+        if (fds[0].revents & (POLLERR | POLLHUP))
+            die("Lost connection to the X server.");
+
+        /* callbacks may add or remove watches, so work from a copy */
+        for (i = 0; i < n; i++)
+            if (fds[i + 1].revents)
+                ready[i].cb(ready[i].fd, fds[i + 1].revents, ready[i].data);
+
+        run_timers();
+    }
 }
 
 int main(int argc, char **argv) {
-    char wid_arg[255];
-    char *wid_placeholder = WID_PLACEHOLDER;
-    int status = 0;
-    unsigned int opacity = OPAQUE;
-
     int i;
-    bool have_argb_visual = false;
-    bool no_input = false;
     bool argb = false;
-    bool set_desktop_type = false;
-    bool fullscreen = false;
-    bool no_focus = false;
-    bool override = false;
-    bool undecorated = false;
-    bool sticky = false;
-    bool below = false;
-    bool above = false;
-    bool skip_taskbar = false;
-    bool skip_pager = false;
     bool daemonize = false;
-    bool force_attach = false;
+    bool pause_covered = false;
+    bool pause_blanked = false;
     bool help = false;
 
-    win_shape shape = SHAPE_RECT;
-    Pixmap mask;
-    GC mask_gc;
-    XGCValues xgcv;
-
     window.width = WIDTH;
     window.height = HEIGHT;
 
     char *geom = NULL;
     char *op = NULL;
     char *sh = NULL;
+    char *scale = NULL;
+    char *image_path = NULL;
+    char *image_mem = NULL;
+    char *stream_path = NULL;
+    char *stream_size = NULL;
+    char *freeze = NULL;
+    char *idle = NULL;
+    char *fps = NULL;
+    char *psi = NULL;
+    char *power = NULL;
+    char *nice = NULL;
+    char *cpus = NULL;
+    char *cgroup = NULL;
+    char *cpu_max = NULL;
+    char *mem_max = NULL;
+    char *restart = NULL;
+    char *playlist_path = NULL;
+    char *rotate = NULL;
+    char *control = NULL;
+    char *pixmap = NULL;
+    char *root_rate = NULL;
+    bool snapshot = false;
     for (i = 1; i < argc; i++) {
         SETFLAG("-a", above);
         SETFLAG("-b", below);
@@ -420,11 +4937,45 @@ int main(int argc, char **argv) {
         SETFLAG("-fdt", set_desktop_type);
         SETFLAG("-argb", argb);
         SETFLAG("-debug", debug);
+        SETFLAG("-trace", trace);
         SETFLAG("-fa", force_attach);
+        SETFLAG("-pc", pause_covered);
+        SETFLAG("-pb", pause_blanked);
+        SETFLAG("-per-output", per_output);
+        SETFLAG("-mirror", mirror_outputs);
         SETARG("-g", geom);
         SETARG("-o", op);
         SETARG("-sh", sh);
         SETARG("-sub", wid_placeholder);
+        SETARG("-fc", attach_class);
+        SETARG("-scale", scale);
+        SETARG("-image", image_path);
+        SETARG("-image-mem", image_mem);
+        SETARG("-stream", stream_path);
+        SETARG("-stream-size", stream_size);
+        SETARG("-freeze", freeze);
+        SETARG("-idle", idle);
+        SETARG("-max-fps", fps);
+        SETARG("-psi", psi);
+        SETARG("-power", power);
+        SETARG("-power-root", power_root);
+        SETFLAG("-sched-idle", child_sched_idle);
+        SETFLAG("-io-idle", child_io_idle);
+        SETARG("-nice", nice);
+        SETARG("-cpus", cpus);
+        SETARG("-cgroup", cgroup);
+        SETARG("-cpu-max", cpu_max);
+        SETARG("-mem-max", mem_max);
+        SETARG("-restart", restart);
+        SETARG("-playlist", playlist_path);
+        SETARG("-rotate", rotate);
+        SETFLAG("-snapshot", snapshot);
+        SETARG("-snapshot-dir", snapshot_dir);
+        SETARG("-control", control);
+        SETARG("-metrics", metrics_path);
+        SETARG("-pixmap-max", pixmap);
+        SETFLAG("-pixmap-restart", pixmap_restart);
+        SETARG("-rootpmap", root_rate);
 
         if (strcmp(argv[i], "--") == 0)
             break;
@@ -442,7 +4993,13 @@ int main(int argc, char **argv) {
             shape = SHAPE_CIRCLE;
         else if (strcmp(sh, "triangle") == 0)
             shape = SHAPE_TRIG;
-        else {
+        else if (access(sh, F_OK) == 0) {
+            const char *error;
+
+            if (!mask_open(sh, &error))
+                die("Couldn't use %s as a shape: %s.", sh, error);
+            shape = SHAPE_MASK;
+        } else {
             usage();
             return 1;
         }
@@ -470,25 +5027,104 @@ int main(int argc, char **argv) {
         close(STDERR_FILENO);
     }
 
-    child_argv = malloc((argc - i + 1) * sizeof(char *));
-    for (i = i + 1; i < argc; i++) {
-        if (strstr(argv[i], wid_placeholder) != NULL) {
-            int l = strlen(argv[i]);
-            memcpy(wid_arg, argv[i], l);
-            wid_arg[l] = '\0';
-            child_argv[child_argc] = wid_arg;
-        } else {
-            child_argv[child_argc] = argv[i];
-        }
-
-        child_argc++;
+    child_argv = &argv[i + 1];
+    child_argc = argc - i - 1;
+    if (image_path != NULL) {
+        if (child_argc > 0 || stream_path != NULL)
+            die("-image cannot be combined with -stream or a command.");
+        if (force_attach || mirror_outputs || scale != NULL)
+            die("-image cannot be combined with -fa, -mirror or -scale.");
+        if (image_mem != NULL)
+            image_budget = atof(image_mem) * (1 << 20);
+    } else if (playlist_path != NULL) {
+        if (child_argc > 0)
+            die("-playlist and a command cannot be combined.");
+        if (force_attach || per_output || scale != NULL)
+            die("-playlist cannot be combined with -fa, -per-output or -scale.");
+        if (rotate != NULL)
+            rotate_ms = atof(rotate) * 1000;
+#ifdef HAVE_XDAMAGE
+        playlist_load(playlist_path);
+#else
+        die("-playlist needs xwinwrap built with Xcomposite and Xdamage.");
+#endif
+    } else if (stream_path != NULL) {
+        if (child_argc > 0)
+            die("-stream and a command cannot be combined.");
+        if (force_attach || mirror_outputs || scale != NULL)
+            die("-stream cannot be combined with -fa, -mirror or -scale.");
+    } else if (child_argc <= 0) {
+        die("No command specified. Use -h to get help.");
+    }
+    if (per_output && force_attach)
+        die("-per-output and -fa cannot be combined.");
+    if ((psi != NULL || power != NULL) && force_attach)
+        die("-psi and -power cannot be combined with -fa.");
+    if (mirror_outputs && !per_output)
+        die("-mirror needs -per-output.");
+    if (scale != NULL) {
+        render_scale = atof(scale);
+        if (render_scale <= 0 || render_scale > 1)
+            die("-scale needs a value between 0 and 1.");
+        if (per_output)
+            die("-scale and -per-output cannot be combined.");
     }
 
-    if (!child_argc)
-        die("No command specified. Use -h to get help.");
+    if (restart != NULL)
+        restart_limit = atoi(restart);
+    if (snapshot && snapshot_dir == NULL)
+        snapshot_dir = make_cache_dir();
+    else if (snapshot_dir)
+        mkdir(snapshot_dir, 0700);
+    if (nice != NULL)
+        child_nice = atoi(nice);
+    if (cpus != NULL)
+        parse_cpus(cpus);
+
+    wm_argv = argv;
+    wm_argc = argc;
 
-    child_argv[child_argc] = NULL;
+    trace_start = trace_last = now_us();
     init_x11();
+    trace_phase("init_x11");
+
+    if (fps != NULL) {
+#ifdef HAVE_XDAMAGE
+        if (!have_damage)
+            die("-max-fps needs the Damage extension.");
+        max_fps = atof(fps);
+        if (max_fps <= 0)
+            die("-max-fps needs a positive rate.");
+#else
+        die("-max-fps needs xwinwrap built with Xdamage.");
+#endif
+    }
+
+    if (root_rate != NULL) {
+        if (scale != NULL || mirror_outputs || child_argc == 0)
+            die("-rootpmap needs a command, and cannot be combined with -scale or -mirror.");
+#ifdef HAVE_XDAMAGE
+        if (!have_damage)
+            die("-rootpmap needs the Composite, Damage and XFixes extensions.");
+        rootpmap.rate = atof(root_rate);
+        if (rootpmap.rate <= 0)
+            die("-rootpmap needs a positive rate.");
+#else
+        die("-rootpmap needs xwinwrap built with Xdamage.");
+#endif
+    }
+
+    if (freeze != NULL) {
+        if (scale != NULL)
+            die("-freeze and -scale cannot be combined.");
+#ifdef HAVE_XDAMAGE
+        if (!have_damage)
+            die("-freeze needs the Damage extension.");
+        freeze_ms = atof(freeze) * 1000;
+#else
+        die("-freeze needs xwinwrap built with Xdamage.");
+#endif
+    }
 
     if (fullscreen) {
         window.x = 0;
@@ -496,11 +5132,10 @@ int main(int argc, char **argv) {
         window.width = DisplayWidth(display, screen);
         window.height = DisplayHeight(display, screen);
     }
-    int depth = 0, flags = CWOverrideRedirect | CWBackingStore;
-    Visual *visual = NULL;
 
     if (!find_desktop_window(&window.root, &window.desktop))
         die("Couldn't find desktop window.");
+    trace_phase("desktop");
 
     if (argb && get_argb_visual(&visual, &depth)) {
         have_argb_visual = true;
@@ -513,254 +5148,206 @@ int main(int argc, char **argv) {
         depth = CopyFromParent;
         visual = CopyFromParent;
     }
+    window.pidfd = -1;
+    trace_phase("visual");
 
-    if (override) {
-        /* An override_redirect True window.
-         * No WM hints or button processing needed. */
-        XSetWindowAttributes attrs = { ParentRelative, 0L, 0, 0L, 0, 0, Always, 0L, 0L, False,
-            StructureNotifyMask | ExposureMask, 0L, True, 0, 0 };
-
-        if (have_argb_visual) {
-            attrs.colormap = window.colourmap;
-            flags |= CWBorderPixel | CWColormap;
-        } else {
-            flags |= CWBackPixel;
-        }
-
-        window.window = XCreateWindow(display, window.desktop, window.x, window.y, window.width,
-            window.height, 0, depth, InputOutput, visual, flags, &attrs);
-        XLowerWindow(display, window.window);
-
-        fprintf(stderr, NAME ": window type - override\n");
-        fflush(stderr);
-    } else {
-        XSetWindowAttributes attrs = { ParentRelative, 0L, 0, 0L, 0, 0, Always, 0L, 0L, False,
-            StructureNotifyMask | ExposureMask | ButtonPressMask | ButtonReleaseMask, 0L, False, 0,
-            0 };
-
-        XWMHints wmHint;
-        Atom xa;
-
-        if (have_argb_visual) {
-            attrs.colormap = window.colourmap;
-            flags |= CWBorderPixel | CWColormap;
-        } else {
-            flags |= CWBackPixel;
-        }
-
-        window.window = XCreateWindow(display, window.root, window.x, window.y, window.width,
-            window.height, 0, depth, InputOutput, visual, flags, &attrs);
-
-        wmHint.flags = InputHint | StateHint;
-        // wmHint.input = undecorated ? False : True;
-        wmHint.input = !no_focus;
-        wmHint.initial_state = NormalState;
-
-        XSetWMProperties(display, window.window, NULL, NULL, argv, argc, NULL, &wmHint, NULL);
-
-        xa = ATOM(_NET_WM_WINDOW_TYPE);
-
-        Atom prop;
-        if (set_desktop_type) {
-            prop = ATOM(_NET_WM_WINDOW_TYPE_DESKTOP);
-        } else {
-            prop = ATOM(_NET_WM_WINDOW_TYPE_NORMAL);
-        }
-
-        XChangeProperty(
-            display, window.window, xa, XA_ATOM, 32, PropModeReplace, (unsigned char *) &prop, 1);
-
-        if (undecorated) {
-            xa = ATOM(_MOTIF_WM_HINTS);
-            if (xa != None) {
-                long prop[5] = { 2, 0, 0, 0, 0 };
-                XChangeProperty(
-                    display, window.window, xa, xa, 32, PropModeReplace, (unsigned char *) prop, 5);
-            }
-        }
-
-        /* Below other windows */
-        if (below) {
-
-            xa = ATOM(_WIN_LAYER);
-            if (xa != None) {
-                long prop = 0;
-
-                XChangeProperty(display, window.window, xa, XA_CARDINAL, 32, PropModeAppend,
-                    (unsigned char *) &prop, 1);
-            }
-
-            xa = ATOM(_NET_WM_STATE);
-            if (xa != None) {
-                Atom xa_prop = ATOM(_NET_WM_STATE_BELOW);
-
-                XChangeProperty(display, window.window, xa, XA_ATOM, 32, PropModeAppend,
-                    (unsigned char *) &xa_prop, 1);
-            }
-        }
-
-        /* Above other windows */
-        if (above) {
-
-            xa = ATOM(_WIN_LAYER);
-            if (xa != None) {
-                long prop = 6;
-
-                XChangeProperty(display, window.window, xa, XA_CARDINAL, 32, PropModeAppend,
-                    (unsigned char *) &prop, 1);
-            }
+    if (per_output)
+        init_outputs();
 
-            xa = ATOM(_NET_WM_STATE);
-            if (xa != None) {
-                Atom xa_prop = ATOM(_NET_WM_STATE_ABOVE);
-
-                XChangeProperty(display, window.window, xa, XA_ATOM, 32, PropModeAppend,
-                    (unsigned char *) &xa_prop, 1);
-            }
-        }
-
-        /* Sticky */
-        if (sticky) {
+    for (i = 0; i < nwindows; i++)
+        create_window(windows[i]);
+#ifdef HAVE_XDAMAGE
+    /* each command of a playlist gets an inner window it can be replaced in */
+    if (nplaylist) {
+        if (!have_damage)
+            die("-playlist needs the Composite and Damage extensions.");
+        create_inner(&window);
+    }
+#endif
 
-            xa = ATOM(_NET_WM_DESKTOP);
-            if (xa != None) {
-                CARD32 xa_prop = 0xFFFFFFFF;
+    /* follow resolution and monitor changes */
+    select_root_input(StructureNotifyMask);
+#ifdef HAVE_XRANDR
+    if (have_xrandr)
+        XRRSelectInput(display, RootWindow(display, screen),
+            RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+#endif
 
-                XChangeProperty(display, window.window, xa, XA_CARDINAL, 32, PropModeAppend,
-                    (unsigned char *) &xa_prop, 1);
-            }
+    if (snapshot_dir) {
+        for (i = 0; i < nwindows; i++)
+            snapshot_load(windows[i]);
+        snapshot_prune();
+        trace_phase("snapshot");
+    }
 
-            xa = ATOM(_NET_WM_STATE);
-            if (xa != None) {
-                Atom xa_prop = ATOM(_NET_WM_STATE_STICKY);
+    if (!force_attach) {
+        for (i = 0; i < nwindows; i++)
+            XMapWindow(display, windows[i]->window);
+        round_trips++;
+        XSync(display, False);
+        trace_phase("map");
+    }
 
-                XChangeProperty(display, window.window, xa, XA_ATOM, 32, PropModeAppend,
-                    (unsigned char *) &xa_prop, 1);
-            }
-        }
+    if (force_attach) {
+        /* listen before the child exists, so no window can be missed */
+        select_root_input(SubstructureNotifyMask);
+        round_trips++;
+        XSync(display, False);
+        attaching = true;
+    }
 
-        /* Skip taskbar */
-        if (skip_taskbar) {
+    /* signals are read from a signalfd and forwarded to the children's
+     * process groups */
+    sigset_t sigs;
+    int sigfd;
 
-            xa = ATOM(_NET_WM_STATE);
-            if (xa != None) {
-                Atom xa_prop = ATOM(_NET_WM_STATE_SKIP_TASKBAR);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigs, &child_sigmask);
+    sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0)
+        die("signalfd failed:");
+    watch_fd(sigfd, POLLIN, on_signal, NULL);
 
-                XChangeProperty(display, window.window, xa, XA_ATOM, 32, PropModeAppend,
-                    (unsigned char *) &xa_prop, 1);
-            }
-        }
+    if (render_scale != 1.0) {
+        mirror_start(window.inner, true);
+        mirror_add_target(&window);
+    }
 
-        /* Skip pager */
-        if (skip_pager) {
+    /* a single child renders into the first window, the others show copies
+     * of it */
+    if (mirror_outputs) {
+        mirror_start(window.window, false);
+        for (i = 1; i < nwindows; i++)
+            mirror_add_target(windows[i]);
+    }
 
-            xa = ATOM(_NET_WM_STATE);
-            if (xa != None) {
-                Atom xa_prop = ATOM(_NET_WM_STATE_SKIP_PAGER);
+#ifdef HAVE_XDAMAGE
+    if (rootpmap.rate)
+        rootpmap_start();
+#endif
 
-                XChangeProperty(display, window.window, xa, XA_ATOM, 32, PropModeAppend,
-                    (unsigned char *) &xa_prop, 1);
-            }
-        }
+    if (image_path != NULL) {
+        image_load(image_path);
+        image_show_frame(0);
+        image_update_playing();
     }
 
-    if (opacity != OPAQUE)
-        set_window_opacity(opacity);
-
-    if (no_input) {
-        Region region;
+    if (stream_path != NULL) {
+        char size[32];
 
-        region = XCreateRegion();
-        if (region) {
-            XShapeCombineRegion(display, window.window, ShapeInput, 0, 0, region, ShapeSet);
-            XDestroyRegion(region);
+        if (stream_size == NULL) {
+            snprintf(size, sizeof(size), "%ux%u", window.width, window.height);
+            stream_size = size;
         }
+        stream_open(stream_path, stream_size);
     }
 
-    if (shape) {
-        mask = XCreatePixmap(display, window.window, window.width, window.height, 1);
-        mask_gc = XCreateGC(display, mask, 0, &xgcv);
-
-        switch (shape) {
-        //Nothing special to be done if it's a rectangle
-        case SHAPE_CIRCLE: {
-            /* fill mask */
-            XSetForeground(display, mask_gc, 0);
-            XFillRectangle(display, mask, mask_gc, 0, 0, window.width, window.height);
+#ifdef HAVE_XDAMAGE
+    if (nplaylist > 1)
+        set_timer(on_rotate_timer, NULL, rotate_ms);
+#endif
 
-            XSetForeground(display, mask_gc, 1);
-            XFillArc(display, mask, mask_gc, 0, 0, window.width, window.height, 0, 23040);
-            break;
-        }
-        case SHAPE_TRIG: {
-            XPoint points[3] = { { 0, window.height }, { window.width / 2, 0 },
-                { window.width, window.height } };
+    if (cgroup != NULL || cpu_max != NULL || mem_max != NULL)
+        cgroup_start(cgroup, cpu_max ? atof(cpu_max) : 0, mem_max);
 
-            XSetForeground(display, mask_gc, 0);
-            XFillRectangle(display, mask, mask_gc, 0, 0, window.width, window.height);
+    for (i = 0; i < (mirror_outputs ? 1 : nwindows) && child_argc > 0; i++)
+        spawn_child(windows[i]);
+    trace_phase("spawn");
 
-            XSetForeground(display, mask_gc, 1);
-            XFillPolygon(display, mask, mask_gc, points, 3, Complex, CoordModeOrigin);
-            break;
-        }
-        default: break;
-        }
-        /* combine */
-        XShapeCombineMask(display, window.window, ShapeBounding, 0, 0, mask, ShapeSet);
-    }
+    if (force_attach)
+        set_timer(on_attach_timeout, NULL, ATTACH_TIMEOUT);
 
-    if (!force_attach) {
-        XMapWindow(display, window.window);
-        XSync(display, window.window);
+    if (pause_covered) {
+        select_root_input(SubstructureNotifyMask | PropertyChangeMask);
+        if (window.desktop != RootWindow(display, screen))
+            XSelectInput(display, window.desktop, SubstructureNotifyMask);
+        visibility_dirty = true;
     }
 
-    char *m = strstr(wid_arg, wid_placeholder);
-    if (m != NULL)
-        sprintf(m, "0x%x", (int) window.window);
-
-    pid = fork();
+#ifdef HAVE_XSS
+    if (pause_blanked && have_xss) {
+        XScreenSaverInfo *info = XScreenSaverAllocInfo();
 
-    switch (pid) {
-    case -1: die("fork failed:");
-    case 0:
-        execvp(child_argv[0], child_argv);
-        perror(child_argv[0]);
-        exit(2);
+        XScreenSaverSelectInput(display, RootWindow(display, screen), ScreenSaverNotifyMask);
+        round_trips++;
+        if (XScreenSaverQueryInfo(display, RootWindow(display, screen), info))
+            screen_saver_changed(info->state == ScreenSaverOn);
+        XFree(info);
     }
+#endif
 
-    signal(SIGTERM, sig_handler);
-    signal(SIGINT, sig_handler);
-
-    for (;;) {
-        if (force_attach) {
-            for (i = 0; i < 100; i++) {
-                usleep(100 * 1000);
-                window.child = find_child_window(pid);
-                if (window.child != 0)
-                    break;
-            }
-            if (window.child == 0) {
-                fprintf(stderr, "could not find any child window");
-                break;
-            }
+    if (idle != NULL) {
+#ifdef HAVE_XSS
+        if (!have_xss)
+            die("-idle needs the MIT-SCREEN-SAVER extension.");
+        idle_ms = atof(idle) * 1000;
+        on_idle_timer(NULL);
+#else
+        die("-idle needs xwinwrap built with Xss.");
+#endif
+    }
 
-            XReparentWindow(display, window.child, window.window, 0, 0);
-            XResizeWindow(display, window.child, window.width, window.height);
+    if (per_output || pause_blanked) {
+        int dpms_event, dpms_error;
 
-            XMapWindow(display, window.window);
-            XSync(display, window.window);
-        }
+        round_trips += 2;
+        if (DPMSQueryExtension(display, &dpms_event, &dpms_error) && DPMSCapable(display))
+            on_dpms_timer(NULL);
+    }
 
-        if (waitpid(pid, &status, 0) != -1) {
-            if (WIFEXITED(status))
-                fprintf(stderr, "%s died, exit status %d\n", child_argv[0], WEXITSTATUS(status));
+    if (pixmap != NULL) {
+#ifdef HAVE_XRES
+        char *end;
 
-            break;
-        }
+        if (!have_xres)
+            die("-pixmap-max needs the X-Resource extension.");
+        pixmap_max = strtod(pixmap, &end) * (1 << 20);
+        if (*end == 'G' || *end == 'g')
+            pixmap_max <<= 10;
+        set_timer(on_pixmap_timer, NULL, PIXMAP_INTERVAL);
+#else
+        die("-pixmap-max needs xwinwrap built with XRes.");
+#endif
     }
+    if (control != NULL)
+        control_start(control);
+    if (metrics_path != NULL)
+        on_metrics_timer(NULL);
+    if (psi != NULL)
+        psi_start(psi);
+    if (power != NULL)
+        power_start(power);
 
-    XDestroyWindow(display, window.window);
+    /* a child that already died is reaped by the first SIGCHLD read */
+    for (i = 0; i < nwindows; i++)
+        reap_child(windows[i]);
+    run_loop(pause_covered);
+#ifdef HAVE_XDAMAGE
+    playlist_stop();
+#endif
+
+    for (i = nwindows - 1; i >= 0; i--)
+        XDestroyWindow(display, windows[i]->window);
+#ifdef HAVE_XDAMAGE
+    if (rootpmap.pixmap)
+        rootpmap_publish(rootpmap.old);
+#endif
     XCloseDisplay(display);
+    if (stream.images[0] && stream.fd == STDIN_FILENO)
+        fcntl(stream.fd, F_SETFL, stream.stdin_flags);
+
+    /* only succeeds once the children are gone */
+    if (cgroup_path)
+        rmdir(cgroup_path);
+    if (control_path)
+        unlink(control_path);
 
     return 0;
 }
@@ -0,0 +1,93 @@
+/*
+ * xwinwrapctl - send a command to the -control socket of a running
+ * xwinwrap and print its reply.
+ *
+ * Usage: xwinwrapctl SOCKET COMMAND [ARG ...]
+ *
+ * The arguments are joined with spaces into one command line. The exit
+ * status is 0 when xwinwrap answered "ok", 1 otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un addr = { AF_UNIX };
+    char line[1024], reply[4096];
+    size_t len = 0, have = 0;
+    int fd, i;
+
+    if (argc < 3) {
+        fprintf(stderr,
+            "Usage: %s SOCKET COMMAND [ARG ...]\n"
+            "Commands:\n"
+            "    set-opacity OPACITY       - between 0 and 1\n"
+            "    set-geometry {w}x{h}+{x}+{y}\n"
+            "    pause, resume             - stop or continue the child, also thawing -freeze\n"
+            "    swap-command COMMAND      - replace the child with COMMAND run by sh -c\n"
+            "    reshape SHAPE             - rectangle, circle, triangle or a PNG or XBM mask\n"
+            "    set-cpu-max PERCENT       - the child's cgroup cpu.max, max for none\n"
+            "    set-mem-max BYTES         - the child's cgroup memory.max, max for none\n"
+            "    stats                     - a line per window\n"
+            "    metrics                   - the -metrics text\n",
+            argv[0]);
+        return 1;
+    }
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", argv[0]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    for (i = 2; i < argc; i++) {
+        int n = snprintf(line + len, sizeof(line) - len, "%s%s", i > 2 ? " " : "", argv[i]);
+
+        if (n < 0 || (size_t) n >= sizeof(line) - len - 1) {
+            fprintf(stderr, "%s: command too long\n", argv[0]);
+            return 1;
+        }
+        len += n;
+    }
+    line[len++] = '\n';
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        die("socket");
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        die(argv[1]);
+    if (write(fd, line, len) != (ssize_t) len)
+        die("write");
+
+    /* print lines up to and including the one with the result */
+    for (;;) {
+        char *start = reply, *end;
+        ssize_t n = read(fd, reply + have, sizeof(reply) - have - 1);
+
+        if (n <= 0) {
+            fprintf(stderr, "%s: no reply\n", argv[0]);
+            return 1;
+        }
+        have += n;
+        reply[have] = '\0';
+        while ((end = strchr(start, '\n'))) {
+            *end = '\0';
+            printf("%s\n", start);
+            if (strncmp(start, "ok", 2) == 0)
+                return 0;
+            if (strncmp(start, "error", 5) == 0)
+                return 1;
+            start = end + 1;
+        }
+        have -= start - reply;
+        memmove(reply, start, have);
+    }
+}